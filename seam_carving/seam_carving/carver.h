@@ -1,10 +1,16 @@
 #pragma once
 
-#include <initializer_list>
 #include <vector>
+#include <cstdint>
 #include <algorithm>
 
 #include "image.h"
+#include "dp_kernels.h"
+#include "thread_pool.h"
+#include "pyramid_search.h"
+#include "energy.h"
+
+#define USE_INCREMENTAL
 
 namespace seam_carving {
 	enum class orientation {
@@ -12,47 +18,77 @@ namespace seam_carving {
 		vertical
 	};
 
-	class simple_retargeter {
-	public:
+	// pixels as floats and the gradient magnitude as default energy
+	struct float_carving_traits {
 		using real_t = float;
-		using color_rgba_r = color_rgba<real_t>;
+		using component_t = float;
+		using color_t = color_rgba<component_t>;
+
+		constexpr static energy_type default_energy = energy_type::gradient_l2;
+	};
+	// pixels kept as they are loaded and the L1 norm of the gradient as default energy. An L1 energy is at most
+	// 6 * 255, so seam energies of images up to 2^32 / 1530 pixels tall fit the integer DP, which is exact and the
+	// same on every compiler
+	struct u8_carving_traits {
+		using real_t = std::uint32_t;
+		using component_t = unsigned char;
+		using color_t = color_rgba<component_t>;
+
+		constexpr static energy_type default_energy = energy_type::l1;
+	};
+
+	// the order in which seams of one orientation remove the pixels of an image: the pixel at (x, y) is removed by
+	// seam number ranks[y * width + x], and pixels that are never removed get the number of seams. Keeping the
+	// pixels whose rank is at least k gives the image with k seams carved
+	struct removal_rank_view {
+		orientation orient;
+		size_t width, height, seams;
+		const std::uint32_t *ranks;
+	};
+	struct removal_rank_map {
+		orientation orient = orientation::vertical;
+		size_t width = 0, height = 0, seams = 0;
+		std::vector<std::uint32_t> ranks;
+
+		removal_rank_view view() const {
+			return {orient, width, height, seams, ranks.data()};
+		}
+	};
+
+	template <typename Traits> class basic_simple_retargeter {
+	public:
+		using real_t = typename Traits::real_t;
+		using component_t = typename Traits::component_t;
+		using color_rgba_r = typename Traits::color_t;
 		using image_rgba_r = image<color_rgba_r>;
+		using planar_image_r = planar_image<component_t>;
 		using carve_path_pixel_data = std::vector<size_t>;
-		struct carve_path {
-			carve_path_pixel_data path_data;
-			std::vector<color_rgba_r> pixel_data;
-			orientation path_orientation = orientation::horizontal;
-		};
+		using dp_kernel = basic_dp_row_kernel<real_t>;
 
-		void set_image(const image_rgba_u8 &img) {
-			image_rgba_r rimg;
-			image_cast(img, rimg);
-			set_image(std::move(rimg));
+		// pixels are stored in planes internally, converted to the traits' component type
+		template <typename Elem> void set_image(const image<color_rgba<Elem>> &img) {
+			planar_cast(img, _carve_img);
+			_set_image();
 		}
-		void set_image(image_rgba_r img) {
+		void set_image(planar_image_r &&img) {
 			_carve_img = std::move(img);
-			_rw = _carve_img.width();
-			_rh = _carve_img.height();
-			_calc_energy();
+			_set_image();
 		}
 		image_rgba_u8 get_image() const {
-			image_rgba_u8 img(_rw, _rh);
-			for (size_t y = 0; y < _rh; ++y) {
-				color_rgba_u8 *dst = img.at_y(y);
-				const image_rgba_r::element_type *src = _carve_img.at_y(y);
-				for (size_t x = 0; x < _rw; ++x, ++src, ++dst) {
-					*dst = src->cast<unsigned char>();
-				}
-			}
+			image_rgba_u8 img;
+			_get_current_image(img);
 			return img;
 		}
 		sys_image get_sys_image(HDC dc) const {
 			sys_image res(dc, _rw, _rh);
 			for (size_t y = 0; y < _rh; ++y) {
 				sys_color *dst = res.at_y(y);
-				const image_rgba_r::element_type *src = _carve_img.at_y(y);
-				for (size_t x = 0; x < _rw; ++x, ++src, ++dst) {
-					*dst = sys_color(src->cast<unsigned char>());
+				const size_t *skip = _removed_row(y), *skipend = skip + _removed_count;
+				for (size_t x = 0, sx = 0; x < _rw; ++x, ++sx, ++dst) {
+					for (; skip != skipend && *skip == sx; ++skip) {
+						++sx;
+					}
+					*dst = sys_color(_carve_img.get(sx, y).template cast<unsigned char>());
 				}
 			}
 			return res;
@@ -65,191 +101,407 @@ namespace seam_carving {
 			return _rh;
 		}
 
-		carve_path_pixel_data get_vertical_carve_path() const {
-			dynamic_array2<_dp_state> dp(_rw, _rh);
-			_dp_state *curv = dp.at_y(0);
-			const real_t *curgrad = _energy.at_y(0);
-			for (size_t x = 0; x < dp.width(); ++x, ++curv, ++curgrad) {
-				*curv = _dp_state(*curgrad);
-			}
-			for (size_t y = 1; y < dp.height(); ++y) {
-				_dp_state *lastv = dp.at_y(y - 1);
-				curv = dp.at_y(y);
-				curgrad = _energy.at_y(y);
-				*curv = _dp_state::minimum({
-					_dp_state(lastv[0].min_energy + *curgrad, 0),
-					_dp_state(lastv[1].min_energy + *curgrad, 1)
-					});
-				++curv, ++curgrad;
-				for (size_t x = 2; x < dp.width(); ++x, ++curv, ++curgrad, ++lastv) {
-					*curv = _dp_state::minimum({
-						_dp_state(lastv[0].min_energy + *curgrad, -1),
-						_dp_state(lastv[1].min_energy + *curgrad, 0),
-						_dp_state(lastv[2].min_energy + *curgrad, 1)
-						});
-				}
-				*curv = _dp_state::minimum({
-					_dp_state(lastv[0].min_energy + *curgrad, -1),
-					_dp_state(lastv[1].min_energy + *curgrad, 0)
-					});
-			}
-			// backtracking
-			carve_path_pixel_data result(dp.height(), 0);
-			curv = dp.at_y(dp.height() - 1);
-			real_t minenergy = curv->min_energy;
-			++curv;
-			for (size_t i = 1; i < dp.width(); ++i, ++curv) {
-				if (curv->min_energy < minenergy) {
-					minenergy = curv->min_energy;
-					result.back() = i;
-				}
-			}
-			for (size_t y = dp.height() - 1, last = result.back(); y > 0; ) {
-				last += dp[y][last].min_energy_diff;
-				result[--y] = last;
+		size_t get_updated_cell_count() const {
+			return _updated_cells;
+		}
+		void reset_updated_cell_count() {
+			_updated_cells = 0;
+		}
+
+		void invalidate_dp_values() {
+			_fresh_dp = false;
+		}
+		// keeps only two rows of cumulative energies instead of the whole table, which leaves a quarter byte per
+		// pixel for the predecessor codes. Every seam then needs a full DP sweep, since the incremental update
+		// works on the whole table
+		void set_compact_dp(bool compact) {
+			_compact_dp = compact;
+			if (_carve_img.width() > 0) {
+				_alloc_workspace();
 			}
-			return result;
 		}
-		carve_path_pixel_data get_horizontal_carve_path() const {
-			dynamic_array2<_dp_state> dp(_carve_img.width(), _carve_img.height());
-			std::vector<_dp_state*> dpheaders(_carve_img.height(), nullptr);
-			std::vector<const real_t*> gheaders(_carve_img.height(), nullptr);
-			for (size_t y = 0; y < dp.height(); ++y) {
-				*(dpheaders[y] = dp.at_y(y)) = _dp_state(*(gheaders[y] = _energy.at_y(y)));
-			}
-			for (size_t x = 1; x < dp.width(); ++x) {
-				real_t curg = *++gheaders[0];
-				dpheaders[0][1] = _dp_state::minimum({
-					_dp_state(dpheaders[0]->min_energy + curg, 0),
-					_dp_state(dpheaders[1]->min_energy + curg, 1)
-					});
-				for (size_t y = 1; y < dp.height() - 1; ++y) {
-					curg = *++gheaders[y];
-					dpheaders[y][1] = _dp_state::minimum({
-						_dp_state(dpheaders[y - 1]->min_energy + curg, -1),
-						_dp_state(dpheaders[y]->min_energy + curg, 0),
-						_dp_state(dpheaders[y + 1]->min_energy + curg, 1),
-						});
-					++dpheaders[y - 1];
-				}
-				curg = *++gheaders.back();
-				dpheaders.back()[1] = _dp_state::minimum({
-					_dp_state(dpheaders.back()->min_energy + curg, -1),
-					_dp_state(dpheaders[dpheaders.size() - 2]->min_energy + curg, 0)
-					});
-				++dpheaders[dpheaders.size() - 2];
-				++dpheaders.back();
-			}
-			// backtracking
-			carve_path_pixel_data result(dp.width(), 0);
-			real_t minenergy = dp[0][dp.width() - 1].min_energy;
-			for (size_t i = 1; i < dp.height(); ++i) {
-				real_t newenergy = dp[i][dp.width() - 1].min_energy;
-				if (newenergy < minenergy) {
-					minenergy = newenergy;
-					result.back() = i;
-				}
-			}
-			for (size_t x = dp.width() - 1, last = result.back(); x > 0; ) {
-				last += dp[last][x].min_energy_diff;
-				result[--x] = last;
+		bool is_compact_dp() const {
+			return _compact_dp;
+		}
+		// computes the energy of each row inside the DP sweep instead of keeping an energy map: a full vertical sweep
+		// then reads every image row once and no map is allocated. Horizontal sweeps and the pyramid search compute
+		// the map they need from the image first, and the incremental DP evaluates the few cells it needs directly.
+		// Energies are recomputed on every full sweep, so this pays off for images larger than the cache with a
+		// cheap energy function
+		void set_fused_energy(bool fused) {
+			_compact();
+			_fused_energy = fused;
+			if (_carve_img.width() > 0) {
+				_alloc_workspace();
+				if (!_fused_energy) {
+					_calc_energy();
+				}
+			}
+		}
+		bool is_fused_energy() const {
+			return _fused_energy;
+		}
+		// vertical carves only record the removed pixel of each row instead of shifting the rest of the row in the
+		// image planes, the energy map and the DP table, and every given number of seams the rows are compacted in a
+		// single pass. A seam then only touches the cells around it and the cone of the incremental DP, each mapped
+		// past the removed elements of its row. Anything that needs whole rows compacts them first: restoring, a
+		// horizontal seam, a full energy computation or a full DP sweep. 0 shifts everything with every seam
+		void set_lazy_compaction(size_t seams) {
+			_compact();
+			_lazy_seams = seams;
+			_removed.assign(_carve_img.height() * _lazy_seams, 0);
+		}
+		size_t get_lazy_compaction() const {
+			return _lazy_seams;
+		}
+		// switches the energy function; the energies are recomputed right away
+		void set_energy(energy_type type) {
+			_energy_type = type;
+			_energy_row = select_energy<_energy_row_selector>(type);
+			_transition_row = select_energy<transition_row_selector<real_t, component_t>>(type);
+			_global_energy = get_energy_properties(type).global;
+			_compact();
+			if (_carve_img.width() > 0) {
+				if (_global_energy) {
+					_calc_mean();
+				}
+				if (!_fused_energy) {
+					_calc_energy();
+				}
 			}
+			_fresh_dp = false;
+		}
+		energy_type get_energy() const {
+			return _energy_type;
+		}
+		// global energies are only recomputed once the mean color has moved by more than this many 8-bit levels in
+		// some channel since they were last computed; 0 recomputes them whenever it changes at all
+		void set_mean_tolerance(float levels) {
+			_mean_tolerance = levels;
+		}
+		float get_mean_tolerance() const {
+			return _mean_tolerance;
+		}
+		// full DP sweeps over rows at least min_width wide (in seam space) are split between this many threads;
+		// 0 uses all hardware threads and 1 keeps them serial. Seams are identical either way
+		void set_dp_threads(size_t threads, size_t min_width = parallel_dp::default_min_width) {
+			_parallel.set_threads(threads, min_width);
+		}
+		size_t get_dp_threads() const {
+			return _parallel.get_threads();
+		}
+		// finds seams coarse-to-fine on an energy pyramid instead of with the exact DP: the seam is searched on a
+		// map downsampled up to levels times, then refined at every finer level within band pixels of it. Larger
+		// bands give seams closer to the exact ones; 0 levels switches back to the exact search. Energies that
+		// charge the steps of seams, which a map cannot hold, always use the exact search
+		void set_pyramid_search(size_t levels, size_t band = 4) {
+			_pyramid.set_levels(levels);
+			_pyramid.set_band(band);
+			_fresh_dp = false;
+		}
+		size_t get_pyramid_levels() const {
+			return _pyramid.get_levels();
+		}
+		size_t get_pyramid_band() const {
+			return _pyramid.get_band();
+		}
+
+		carve_path_pixel_data get_vertical_carve_path() {
+			carve_path_pixel_data result(_rh, 0);
+			get_vertical_carve_path(result.data());
+			return result;
+		}
+		carve_path_pixel_data get_horizontal_carve_path() {
+			carve_path_pixel_data result(_rw, 0);
+			get_horizontal_carve_path(result.data());
 			return result;
 		}
+		// these two write the seam into path, which must hold current_height() / current_width() elements
+		void get_vertical_carve_path(size_t *path) {
+			if (_pyramid.get_levels() > 0 && !_transition_row) {
+				_get_pyramid_carve_path(orientation::vertical, path);
+				return;
+			}
+			_update_dp(orientation::vertical);
+			_get_carve_path_impl(_rw, _rh, path);
+		}
+		void get_horizontal_carve_path(size_t *path) {
+			if (_pyramid.get_levels() > 0 && !_transition_row) {
+				_get_pyramid_carve_path(orientation::horizontal, path);
+				return;
+			}
+			_update_dp(orientation::horizontal);
+			_get_carve_path_impl(_rh, _rw, path);
+		}
+		// the total energy of the pixels on a seam, e.g. to compare seams found in different ways. Transition costs
+		// are not included
+		real_t get_vertical_seam_energy(const size_t *path) const {
+			real_t sum = 0;
+			for (size_t y = 0; y < _rh; ++y) {
+				sum += _fused_energy ? _calc_energy_at(path[y], y) : _energy.at(_physical_x(path[y], y), y);
+			}
+			return sum;
+		}
+		real_t get_horizontal_seam_energy(const size_t *path) const {
+			real_t sum = 0;
+			for (size_t x = 0; x < _rw; ++x) {
+				sum += _fused_energy ? _calc_energy_at(x, path[x]) : _energy.at(_physical_x(x, path[x]), path[x]);
+			}
+			return sum;
+		}
 		image_rgba_r carve_vertical(const carve_path_pixel_data &data) const {
-			return carve_vertical(_carve_img, data);
+			image_rgba_r img;
+			_get_current_image(img);
+			return carve_vertical(img, data);
 		}
 		image_rgba_r carve_horizontal(const carve_path_pixel_data &data) const {
-			return carve_horizontal(_carve_img, data);
+			image_rgba_r img;
+			_get_current_image(img);
+			return carve_horizontal(img, data);
 		}
 		void carve_vertical_in_situ(const carve_path_pixel_data &data) {
 			assert(data.size() == _rh);
+			carve_vertical_in_situ(data.data());
+		}
+		void carve_horizontal_in_situ(const carve_path_pixel_data &data) {
+			assert(data.size() == _rw);
+			carve_horizontal_in_situ(data.data());
+		}
+		void restore_vertical_in_situ(const carve_path_pixel_data &data, const std::vector<color_rgba_r> &pixels) {
+			assert(data.size() == _rh && pixels.size() == _rh);
+			restore_vertical_in_situ(data.data(), pixels.data());
+		}
+		void restore_horizontal_in_situ(const carve_path_pixel_data &data, const std::vector<color_rgba_r> &pixels) {
+			assert(data.size() == _rw && pixels.size() == _rw);
+			restore_horizontal_in_situ(data.data(), pixels.data());
+		}
+		// each plane and the energy map are shifted separately, so that the inner loops are plain copies
+		void carve_vertical_in_situ(const size_t *data) {
+			_add_seam_colors(orientation::vertical, data, -1.0);
 			--_rw;
 			for (size_t y = 0; y < _rh; ++y) {
-				color_rgba_r *pos = &_carve_img.at(data[y], y);
-				for (size_t x = data[y]; x < _rw; ++x, ++pos) {
-					pos[0] = pos[1];
+				size_t x = data[y];
+				if (_lazy_seams > 0) {
+					_add_removed(y, _physical_x(x, y));
+					continue;
+				}
+				for (size_t c = 0; c < _carve_img.planes(); ++c) {
+					component_t *row = _carve_img.row(c, y);
+					std::memmove(row + x, row + x + 1, sizeof(component_t) * (_rw - x));
+				}
+				if (!_fused_energy) {
+					real_t *erow = _energy.at_y(y);
+					std::memmove(erow + x, erow + x + 1, sizeof(real_t) * (_rw - x));
 				}
 			}
-			_calc_energy();
+			if (_lazy_seams > 0 && ++_removed_count == _lazy_seams) {
+				_compact();
+			}
+			_update_energy_vertical(data);
+			_carve_dp(orientation::vertical, data);
 		}
-		void carve_horizontal_in_situ(const carve_path_pixel_data &data) {
-			assert(data.size() == _rw);
+		void carve_horizontal_in_situ(const size_t *data) {
+			_compact();
+			_add_seam_colors(orientation::horizontal, data, -1.0);
 			--_rh;
-			for (size_t x = 0; x < _rw; ++x) {
-				for (size_t y = data[x]; y < _rh; ++y) {
-					_carve_img[y][x] = _carve_img[y + 1][x];
+			size_t ymin = *std::min_element(data, data + _rw);
+			for (size_t c = 0; c < _carve_img.planes(); ++c) {
+				for (size_t y = ymin; y < _rh; ++y) {
+					_shift_up(_carve_img.row(c, y), _carve_img.row(c, y + 1), data, y);
 				}
 			}
-			_calc_energy();
+			if (!_fused_energy) {
+				for (size_t y = ymin; y < _rh; ++y) {
+					_shift_up(_energy.at_y(y), _energy.at_y(y + 1), data, y);
+				}
+			}
+			_update_energy_horizontal(data);
+			_carve_dp(orientation::horizontal, data);
 		}
-		void restore_vertical_in_situ(const carve_path_pixel_data &data, const std::vector<color_rgba_r> &pixels) {
-			assert(data.size() == _rh && pixels.size() == _rh);
+		void restore_vertical_in_situ(const size_t *data, const color_rgba_r *pixels) {
+			_compact();
 			for (size_t y = 0; y < _rh; ++y) {
-				color_rgba_r *pos = &_carve_img.at(_rw, y);
-				for (size_t x = _rw; x > data[y]; --x, --pos) {
-					pos[0] = pos[-1];
+				size_t x = data[y];
+				for (size_t c = 0; c < _carve_img.planes(); ++c) {
+					component_t *row = _carve_img.row(c, y);
+					std::memmove(row + x + 1, row + x, sizeof(component_t) * (_rw - x));
+				}
+				if (!_fused_energy) {
+					real_t *erow = _energy.at_y(y);
+					std::memmove(erow + x + 1, erow + x, sizeof(real_t) * (_rw - x));
 				}
-				*pos = pixels[y];
+				_carve_img.set(x, y, pixels[y]);
 			}
 			++_rw;
-			_calc_energy();
+			_add_seam_colors(orientation::vertical, data, 1.0);
+			_update_energy_vertical(data);
+			_fresh_dp = false;
 		}
-		void restore_horizontal_in_situ(const carve_path_pixel_data &data, const std::vector<color_rgba_r> &pixels) {
-			assert(data.size() == _rw && pixels.size() == _rw);
-			for (size_t x = 0; x < _rw; ++x) {
-				for (size_t y = _rh; y > data[x]; --y) {
-					_carve_img[y][x] = _carve_img[y - 1][x];
+		void restore_horizontal_in_situ(const size_t *data, const color_rgba_r *pixels) {
+			_compact();
+			size_t ymin = *std::min_element(data, data + _rw);
+			for (size_t c = 0; c < _carve_img.planes(); ++c) {
+				for (size_t y = _rh; y > ymin; --y) {
+					_shift_down(_carve_img.row(c, y), _carve_img.row(c, y - 1), data, y);
+				}
+			}
+			if (!_fused_energy) {
+				for (size_t y = _rh; y > ymin; --y) {
+					_shift_down(_energy.at_y(y), _energy.at_y(y - 1), data, y);
 				}
-				_carve_img[data[x]][x] = pixels[x];
+			}
+			for (size_t x = 0; x < _rw; ++x) {
+				_carve_img.set(x, data[x], pixels[x]);
 			}
 			++_rh;
-			_calc_energy();
+			_add_seam_colors(orientation::horizontal, data, 1.0);
+			_update_energy_horizontal(data);
+			_fresh_dp = false;
 		}
 
 		void retarget(size_t w, size_t h) {
 			if (w < _rw || h < _rh) {
 				while (_rw > w || _rh > h) {
 					if (_rw > w) {
-						carve_path path;
-						path.path_orientation = orientation::vertical;
-						path.path_data = get_vertical_carve_path();
-						path.pixel_data = get_carved_pixels_vertical(_carve_img, path.path_data);
-						carve_vertical_in_situ(path.path_data);
-						_carved.push_back(std::move(path));
+						_carve_recorded(orientation::vertical);
 					}
 					if (_rh > h) {
-						carve_path path;
-						path.path_orientation = orientation::horizontal;
-						path.path_data = get_horizontal_carve_path();
-						path.pixel_data = get_carved_pixels_horizontal(_carve_img, path.path_data);
-						carve_horizontal_in_situ(path.path_data);
-						_carved.push_back(std::move(path));
+						_carve_recorded(orientation::horizontal);
 					}
 				}
 			} else {
 				while (_carved.size() > 0 && (
-					(w > _rw && _carved.back().path_orientation == orientation::vertical) ||
-					(h > _rh && _carved.back().path_orientation == orientation::horizontal)
+					(w > _rw && _carved.back().orient == orientation::vertical) ||
+					(h > _rh && _carved.back().orient == orientation::horizontal)
 					)) {
-					switch (_carved.back().path_orientation) {
-					case orientation::horizontal:
-						restore_horizontal_in_situ(_carved.back().path_data, _carved.back().pixel_data);
-						break;
-					case orientation::vertical:
-						restore_vertical_in_situ(_carved.back().path_data, _carved.back().pixel_data);
-						break;
+					_restore_recorded();
+				}
+			}
+		}
+		// limits the undo history of retarget() to about this many bytes; the oldest seams are dropped beyond it, and
+		// retarget() then stops growing the image where the history ends. 0 keeps every seam
+		void set_history_budget(size_t bytes) {
+			_history_budget = bytes;
+			_limit_history();
+		}
+		size_t get_history_budget() const {
+			return _history_budget;
+		}
+		size_t get_history_bytes() const {
+			return
+				_carved.size() * sizeof(_carved_seam) + _carved_codes.size() +
+				_carved_pixels.size() * sizeof(color_rgba_u8);
+		}
+
+		// carves the current image down to min_size pixels in the given direction, recording which seam removes each
+		// pixel. The image, energy and history are left as they were, only the DP has to be recomputed afterwards
+		removal_rank_map compute_removal_ranks(orientation orient, size_t min_size = 2) {
+			bool vertical = orient == orientation::vertical;
+			size_t w = _rw, h = _rh, len = vertical ? h : w, size = vertical ? w : h;
+			assert(min_size > 1 && min_size <= size);
+			removal_rank_map map;
+			map.orient = orient;
+			map.width = w;
+			map.height = h;
+			map.seams = size - min_size;
+			map.ranks.assign(w * h, static_cast<std::uint32_t>(map.seams));
+
+			_compact();
+			planar_image_r img = _carve_img;
+			dynamic_array2<real_t> energy = _energy;
+			double color_sum[3];
+			float mean[3];
+			std::copy(_color_sum, _color_sum + 3, color_sum);
+			std::copy(_mean, _mean + 3, mean);
+			// the original column (vertical) or row (horizontal) of every pixel, moved along with the pixels
+			dynamic_array2<std::uint32_t> origin(_carve_img.width(), _carve_img.height());
+			for (size_t y = 0; y < h; ++y) {
+				for (size_t x = 0; x < w; ++x) {
+					origin.at(x, y) = static_cast<std::uint32_t>(vertical ? x : y);
+				}
+			}
+			std::vector<size_t> path(len);
+			for (size_t k = 0; k < map.seams; ++k) {
+				std::uint32_t rank = static_cast<std::uint32_t>(k);
+				if (vertical) {
+					get_vertical_carve_path(path.data());
+					for (size_t y = 0; y < h; ++y) {
+						std::uint32_t *row = origin.at_y(y);
+						map.ranks[y * w + row[path[y]]] = rank;
+						std::memmove(row + path[y], row + path[y] + 1, sizeof(std::uint32_t) * (_rw - 1 - path[y]));
+					}
+					carve_vertical_in_situ(path.data());
+				} else {
+					get_horizontal_carve_path(path.data());
+					for (size_t x = 0; x < w; ++x) {
+						map.ranks[origin.at(x, path[x]) * w + x] = rank;
+					}
+					size_t ymin = *std::min_element(path.begin(), path.end());
+					for (size_t y = ymin; y + 1 < _rh; ++y) {
+						_shift_up(origin.at_y(y), origin.at_y(y + 1), path.data(), y);
+					}
+					carve_horizontal_in_situ(path.data());
+				}
+			}
+
+			_carve_img = std::move(img);
+			_energy = std::move(energy);
+			_removed_count = 0;
+			_rw = w;
+			_rh = h;
+			std::copy(color_sum, color_sum + 3, _color_sum);
+			std::copy(mean, mean + 3, _mean);
+			_fresh_dp = false;
+			return map;
+		}
+		// the image with the seams of map carved until it is size pixels wide (vertical) or tall (horizontal), in a
+		// single pass over img, which must be the image the map was computed for. Ranks that keep more than size
+		// pixels in a row or column, as a corrupt map file may hold, only have the first ones kept
+		template <typename Color> inline static image<Color> retarget_with_ranks(
+			const image<Color> &img, const removal_rank_map &map, size_t size
+		) {
+			return retarget_with_ranks(img, map.view(), size);
+		}
+		template <typename Color> inline static image<Color> retarget_with_ranks(
+			const image<Color> &img, const removal_rank_view &map, size_t size
+		) {
+			assert(img.width() == map.width && img.height() == map.height);
+			bool vertical = map.orient == orientation::vertical;
+			assert(size + map.seams >= (vertical ? map.width : map.height) && size <= (vertical ? map.width : map.height));
+			std::uint32_t keep = static_cast<std::uint32_t>((vertical ? map.width : map.height) - size);
+			image<Color> result(vertical ? size : map.width, vertical ? map.height : size);
+			if (vertical) {
+				for (size_t y = 0; y < map.height; ++y) {
+					const Color *src = img.at_y(y);
+					const std::uint32_t *rank = map.ranks + y * map.width;
+					Color *dst = result.at_y(y), *end = dst + size;
+					for (size_t x = 0; x < map.width; ++x) {
+						if (rank[x] >= keep && dst != end) {
+							*dst++ = src[x];
+						}
+					}
+				}
+			} else {
+				// every column keeps exactly size pixels, so each source row only moves pixels up within their column
+				std::vector<size_t> out(map.width, 0);
+				for (size_t y = 0; y < map.height; ++y) {
+					const Color *src = img.at_y(y);
+					const std::uint32_t *rank = map.ranks + y * map.width;
+					for (size_t x = 0; x < map.width; ++x) {
+						if (rank[x] >= keep && out[x] < size) {
+							result.at(x, out[x]++) = src[x];
+						}
 					}
-					_carved.pop_back();
 				}
 			}
+			return result;
 		}
 
 		template <typename Color> inline static std::vector<Color> get_carved_pixels_vertical(
 			const image<Color> &img, const carve_path_pixel_data &data
 		) {
-			std::vector<Color> result(img.height(), Color());
-			for (size_t i = 0; i < img.height(); ++i) {
+			std::vector<Color> result(data.size(), Color());
+			for (size_t i = 0; i < data.size(); ++i) {
 				result[i] = img[i][data[i]];
 			}
 			return result;
@@ -257,8 +509,8 @@ namespace seam_carving {
 		template <typename Color> inline static std::vector<Color> get_carved_pixels_horizontal(
 			const image<Color> &img, const carve_path_pixel_data &data
 		) {
-			std::vector<Color> result(img.width(), Color());
-			for (size_t i = 0; i < img.width(); ++i) {
+			std::vector<Color> result(data.size(), Color());
+			for (size_t i = 0; i < data.size(); ++i) {
 				result[i] = img[data[i]][i];
 			}
 			return result;
@@ -327,82 +579,753 @@ namespace seam_carving {
 			return result;
 		}
 	protected:
-		image_rgba_r _carve_img;
+		planar_image_r _carve_img;
 		dynamic_array2<real_t> _energy;
 		size_t _rw = 0, _rh = 0;
-		std::vector<carve_path> _carved;
+		// undo history: one entry per carved seam. A seam is stored as its first position and the 2-bit codes of
+		// the moves to the next ones (the predecessor codes of the DP, 4 per byte), and its pixels at 8 bits per
+		// channel; both are kept back to back for all seams, and popping keeps the capacity. Each seam's length
+		// follows from where the next one starts
+		struct _carved_seam {
+			orientation orient;
+			std::uint32_t start;
+			size_t codes, pixels;
+		};
+		std::vector<_carved_seam> _carved;
+		std::vector<unsigned char> _carved_codes;
+		std::vector<color_rgba_u8> _carved_pixels;
+		size_t _history_budget = 0;
+		// the seam being recorded or restored
+		carve_path_pixel_data _history_path;
+		std::vector<color_rgba_r> _history_pixels;
+		// the DP table is kept between seams in seam space, where the seam runs from top to bottom: image
+		// coordinates for vertical seams and transposed ones for horizontal seams. It, the packed predecessor
+		// codes and the transposed energy map are allocated once at the original size; rows of cumulative
+		// energies are _dp_stride elements apart. In compact mode only two rows of energies are kept
+		dynamic_array2<real_t> _transposed;
+		std::vector<real_t> _dp;
+		std::vector<unsigned char> _dp_dirs;
+		size_t _dp_stride = 0;
+		orientation _dp_orientation = orientation::vertical;
+		bool _fresh_dp = false, _compact_dp = false, _fused_energy = false;
+		// lazy compaction: the columns of the _removed_count removed elements of each row of the planes, in
+		// increasing order. Row y starts at _removed[y * _lazy_seams]
+		std::vector<size_t> _removed;
+		size_t _lazy_seams = 0, _removed_count = 0;
+		std::vector<real_t> _dp_gather;
+		size_t _updated_cells = 0;
+		// rows of energy computed on the fly in fused mode: one row for the vertical sweep, or a block of rows that
+		// is transposed as a whole for horizontal seams
+		std::vector<real_t> _energy_rows;
+		constexpr static size_t _fused_block = 32;
+		// the row kernel of the current energy function. For global ones, the color sums of the current image are
+		// kept up to date with every seam, and _mean is the mean color the energies were computed with
+		struct _energy_row_selector {
+			using result_type = void (*)(const energy_rows<component_t>&, const float*, size_t, real_t*, size_t, size_t);
 
-		struct _dp_state {
-			_dp_state() = default;
-			_dp_state(real_t energy, int diff = 0) : min_energy(energy), min_energy_diff(diff) {
+			template <typename Policy> inline static result_type get() {
+				return &energy_row<Policy, real_t, component_t>;
 			}
+		};
+		energy_type _energy_type = Traits::default_energy;
+		typename _energy_row_selector::result_type _energy_row = select_energy<_energy_row_selector>(Traits::default_energy);
+		// the transition costs of energies that charge the steps of seams, nullptr for the others. A sweep computes
+		// them line by line into the three rows of _steps, from the image or for horizontal seams from its planes
+		// transposed into _transposed_planes
+		typename transition_row_selector<real_t, component_t>::result_type _transition_row =
+			select_energy<transition_row_selector<real_t, component_t>>(Traits::default_energy);
+		std::vector<real_t> _steps;
+		std::vector<component_t> _transposed_planes;
+		bool _global_energy = get_energy_properties(Traits::default_energy).global;
+		double _color_sum[3] = {0.0, 0.0, 0.0};
+		float _mean[3] = {0.0f, 0.0f, 0.0f}, _mean_tolerance = 1.0f;
+		parallel_dp _parallel;
+		basic_pyramid_seam_search<real_t> _pyramid;
 
-			real_t min_energy = 0.0f;
-			int min_energy_diff = 0;
+		// one row of a horizontal carve / restore: the elements at or below / below the seam move by one row
+		template <typename T> void _shift_up(T *cur, const T *next, const size_t *data, size_t y) const {
+			for (size_t x = 0; x < _rw; ++x) {
+				cur[x] = y >= data[x] ? next[x] : cur[x];
+			}
+		}
+		template <typename T> void _shift_down(T *cur, const T *prev, const size_t *data, size_t y) const {
+			for (size_t x = 0; x < _rw; ++x) {
+				cur[x] = y > data[x] ? prev[x] : cur[x];
+			}
+		}
+		void _set_image() {
+			_rw = _carve_img.width();
+			_rh = _carve_img.height();
+			_removed.assign(_rh * _lazy_seams, 0);
+			_removed_count = 0;
+			_carved.clear();
+			_carved_codes.clear();
+			_carved_pixels.clear();
+			_alloc_workspace();
+			if (_global_energy) {
+				_calc_mean();
+			}
+			if (!_fused_energy) {
+				_calc_energy();
+			}
+		}
+		void _alloc_workspace() {
+			size_t w = _carve_img.width(), h = _carve_img.height();
+			if (_transposed.width() != w || _transposed.height() != h) {
+				_transposed = dynamic_array2<real_t>(w, h);
+				_dp_dirs = std::vector<unsigned char>(std::max(
+					h * dp_kernel::code_bytes(w), w * dp_kernel::code_bytes(h)
+				), 0);
+			}
+			if (_fused_energy) {
+				_energy = dynamic_array2<real_t>();
+				_energy_rows.resize(_fused_block * w);
+			} else {
+				if (_energy.width() != w || _energy.height() != h) {
+					_energy = dynamic_array2<real_t>(w, h);
+				}
+				_energy_rows = std::vector<real_t>();
+			}
+			_steps.resize(3 * std::max(w, h));
+			size_t dpsize = _compact_dp ? 2 * std::max(w, h) : w * h;
+			if (_dp.size() != dpsize) {
+				_dp = std::vector<real_t>(dpsize, real_t());
+			}
+			_fresh_dp = false;
+		}
+		real_t *_dp_row(size_t y) {
+			return _dp.data() + (_compact_dp ? y & 1 : y) * _dp_stride;
+		}
+		const real_t *_dp_row(size_t y) const {
+			return _dp.data() + (_compact_dp ? y & 1 : y) * _dp_stride;
+		}
+		unsigned char *_dp_dirs_row(size_t y) {
+			return _dp_dirs.data() + y * dp_kernel::code_bytes(_dp_stride);
+		}
+		const unsigned char *_dp_dirs_row(size_t y) const {
+			return _dp_dirs.data() + y * dp_kernel::code_bytes(_dp_stride);
+		}
 
-			inline static _dp_state minimum(std::initializer_list<_dp_state> vars) {
-				auto miter = vars.begin();
-				for (auto c = miter + 1; c != vars.end(); ++c) {
-					if (c->min_energy < miter->min_energy) {
-						miter = c;
+		void _carve_recorded(orientation orient) {
+			size_t len = orient == orientation::vertical ? _rh : _rw;
+			_history_path.resize(len);
+			size_t *path = _history_path.data();
+			_carved_seam seam{orient, 0, _carved_codes.size(), _carved_pixels.size()};
+			_carved_pixels.resize(seam.pixels + len);
+			color_rgba_u8 *pixels = &_carved_pixels[seam.pixels];
+			if (orient == orientation::vertical) {
+				get_vertical_carve_path(path);
+				for (size_t y = 0; y < len; ++y) {
+					pixels[y] = _carve_img.get(_physical_x(path[y], y), y).template cast<unsigned char>();
+				}
+			} else {
+				get_horizontal_carve_path(path);
+				for (size_t x = 0; x < len; ++x) {
+					pixels[x] = _carve_img.get(_physical_x(x, path[x]), path[x]).template cast<unsigned char>();
+				}
+			}
+			// seams move by at most one pixel per step
+			seam.start = static_cast<std::uint32_t>(path[0]);
+			_carved_codes.resize(seam.codes + (len + 2) / 4, 0);
+			unsigned char *codes = &_carved_codes[seam.codes];
+			for (size_t i = 1; i < len; ++i) {
+				assert(path[i] + 1 >= path[i - 1] && path[i] <= path[i - 1] + 1);
+				codes[(i - 1) / 4] |= static_cast<unsigned char>((path[i] + 1 - path[i - 1]) << ((i - 1) % 4 * 2));
+			}
+			if (orient == orientation::vertical) {
+				carve_vertical_in_situ(path);
+			} else {
+				carve_horizontal_in_situ(path);
+			}
+			_carved.push_back(seam);
+			_limit_history();
+		}
+		void _restore_recorded() {
+			_carved_seam seam = _carved.back();
+			size_t len = _carved_pixels.size() - seam.pixels;
+			_history_path.resize(len);
+			_history_pixels.resize(len);
+			const unsigned char *codes = &_carved_codes[seam.codes];
+			_history_path[0] = seam.start;
+			for (size_t i = 1; i < len; ++i) {
+				_history_path[i] = _history_path[i - 1] + ((codes[(i - 1) / 4] >> ((i - 1) % 4 * 2)) & 3) - 1;
+			}
+			for (size_t i = 0; i < len; ++i) {
+				_history_pixels[i] = _carved_pixels[seam.pixels + i].template cast<component_t>();
+			}
+			if (seam.orient == orientation::vertical) {
+				restore_vertical_in_situ(_history_path.data(), _history_pixels.data());
+			} else {
+				restore_horizontal_in_situ(_history_path.data(), _history_pixels.data());
+			}
+			_carved_codes.resize(seam.codes);
+			_carved_pixels.resize(seam.pixels);
+			_carved.pop_back();
+		}
+		// drops the oldest seams once the history is over budget, until a quarter of the budget is free, so that
+		// the rest of the history is moved only every so many seams
+		void _limit_history() {
+			if (_history_budget == 0 || get_history_bytes() <= _history_budget) {
+				return;
+			}
+			size_t target = _history_budget - _history_budget / 4, total = get_history_bytes(), count = 0;
+			for (; count < _carved.size(); ++count) {
+				const _carved_seam &seam = _carved[count];
+				size_t dropped = count * sizeof(_carved_seam) + seam.codes + seam.pixels * sizeof(color_rgba_u8);
+				if (total - dropped <= target) {
+					break;
+				}
+			}
+			size_t codes = count < _carved.size() ? _carved[count].codes : _carved_codes.size();
+			size_t pixels = count < _carved.size() ? _carved[count].pixels : _carved_pixels.size();
+			_carved.erase(_carved.begin(), _carved.begin() + count);
+			_carved_codes.erase(_carved_codes.begin(), _carved_codes.begin() + codes);
+			_carved_pixels.erase(_carved_pixels.begin(), _carved_pixels.begin() + pixels);
+			for (_carved_seam &seam : _carved) {
+				seam.codes -= codes;
+				seam.pixels -= pixels;
+			}
+		}
+
+		void _update_dp(orientation orient) {
+#ifdef USE_INCREMENTAL
+			if (_fresh_dp && _dp_orientation == orient) {
+				return;
+			}
+#endif
+			_recalc_dp(orient);
+		}
+		void _recalc_dp(orientation orient) {
+			if (_fused_energy && orient == orientation::vertical) {
+				_recalc_dp_fused();
+				return;
+			}
+			// the table is rebuilt, so compacting the rows for _seam_energy() leaves it alone
+			_fresh_dp = false;
+			size_t w = _rw, h = _rh, stride;
+			_dp_stride = _carve_img.width();
+			if (orient == orientation::horizontal) {
+				// horizontal seams are vertical seams of the transposed energy map, so they share the row kernel
+				std::swap(w, h);
+				_dp_stride = _carve_img.height();
+			}
+			const real_t *energy = _seam_energy(orient, stride);
+			if (_transition_row && orient == orientation::horizontal) {
+				_transpose_planes();
+			}
+			std::memcpy(_dp_row(0), energy, sizeof(real_t) * w);
+			_add_first_steps(orient, w);
+			if (_parallel.enabled_for(w)) {
+				_parallel.run([&](size_t t, size_t n, spin_barrier &barrier) {
+					size_t begin = parallel_dp::chunk_begin(t, n, w), end = parallel_dp::chunk_begin(t + 1, n, w);
+					for (size_t y = 1; y < h; ++y) {
+						_dp_range(orient, energy + y * stride, y, begin, end, w);
+						barrier.wait();
 					}
+				});
+			} else {
+				for (size_t y = 1; y < h; ++y) {
+					_dp_range(orient, energy + y * stride, y, 0, w, w);
 				}
-				return *miter;
 			}
-		};
+			_updated_cells += w * h;
+			_dp_orientation = orient;
+			_fresh_dp = true;
+		}
+		// the vertical sweep of fused mode: each row of energy is computed right before the DP row that consumes it,
+		// while the three image rows it reads are still in cache
+		void _recalc_dp_fused() {
+			_fresh_dp = false;
+			_compact();
+			size_t w = _rw, h = _rh;
+			_dp_stride = _carve_img.width();
+			_calc_energy_row(0, _dp_row(0));
+			_add_first_steps(orientation::vertical, w);
+			real_t *energy = _energy_rows.data();
+			if (_parallel.enabled_for(w)) {
+				// every thread computes and reads only the energies of its own chunk
+				_parallel.run([&](size_t t, size_t n, spin_barrier &barrier) {
+					size_t begin = parallel_dp::chunk_begin(t, n, w), end = parallel_dp::chunk_begin(t + 1, n, w);
+					for (size_t y = 1; y < h; ++y) {
+						_calc_energy_range(y, energy, begin, end);
+						_dp_range(orientation::vertical, energy, y, begin, end, w);
+						barrier.wait();
+					}
+				});
+			} else {
+				for (size_t y = 1; y < h; ++y) {
+					_calc_energy_row(y, energy);
+					_dp_range(orientation::vertical, energy, y, 0, w, w);
+				}
+			}
+			_updated_cells += w * h;
+			_dp_orientation = orientation::vertical;
+			_fresh_dp = true;
+		}
+		// columns [begin, end) of DP row y of a sweep, with the transition costs of the energy if it has them
+		void _dp_range(orientation orient, const real_t *energy, size_t y, size_t begin, size_t end, size_t w) {
+			if (!_transition_row) {
+				dp_kernel::range(_dp_row(y - 1), energy, _dp_row(y), _dp_dirs_row(y), begin, end, w);
+				return;
+			}
+			real_t *steps[3];
+			_get_steps(steps);
+			real_t *part[3] = {steps[0] + begin, steps[1] + begin, steps[2] + begin};
+			_transition_row(_seam_lines(orient, y), w, part, begin, end);
+			const real_t *const rows[3] = {steps[0], steps[1], steps[2]};
+			dp_kernel::range(_dp_row(y - 1), energy, rows, _dp_row(y), _dp_dirs_row(y), begin, end, w);
+		}
+		// the first line of a seam pays the cost of a straight step
+		void _add_first_steps(orientation orient, size_t w) {
+			if (!_transition_row) {
+				return;
+			}
+			real_t *steps[3], *dp = _dp_row(0);
+			_get_steps(steps);
+			_transition_row(_seam_lines(orient, 0), w, steps, 0, w);
+			for (size_t x = 0; x < w; ++x) {
+				dp[x] += steps[1][x];
+			}
+		}
+		void _get_steps(real_t **steps) {
+			for (size_t k = 0; k < 3; ++k) {
+				steps[k] = _steps.data() + k * _dp_stride;
+			}
+		}
+		// line y of seam space and the one before it, from the image or its transposed planes
+		energy_rows<component_t> _seam_lines(orientation orient, size_t y) const {
+			size_t yu = y > 0 ? y - 1 : y;
+			if (orient == orientation::vertical) {
+				return _get_energy_rows(y, yu, y);
+			}
+			const component_t *planes = _transposed_planes.data();
+			size_t plane = _rw * _rh;
+			return {
+				{planes + yu * _rh, planes + plane + yu * _rh, planes + 2 * plane + yu * _rh},
+				{planes + y * _rh, planes + plane + y * _rh, planes + 2 * plane + y * _rh},
+				{planes + y * _rh, planes + plane + y * _rh, planes + 2 * plane + y * _rh}
+			};
+		}
+		void _transpose_planes() {
+			size_t plane = _rw * _rh;
+			_transposed_planes.resize(3 * plane);
+			for (size_t c = 0; c < 3; ++c) {
+				transpose(_carve_img.row(c, 0), _carve_img.stride(), _transposed_planes.data() + c * plane, _rh, _rw, _rh);
+			}
+		}
+		// the energy map in seam space, with rows stride elements apart. In fused mode it is computed from the image
+		const real_t *_seam_energy(orientation orient, size_t &stride) {
+			_compact();
+			if (orient == orientation::vertical) {
+				if (!_fused_energy) {
+					stride = _energy.width();
+					return _energy.data();
+				}
+				stride = _rw;
+				for (size_t y = 0; y < _rh; ++y) {
+					_calc_energy_row(y, _transposed.data() + y * stride);
+				}
+				return _transposed.data();
+			}
+			stride = _rh;
+			if (!_fused_energy) {
+				transpose(_energy.data(), _energy.width(), _transposed.data(), _rh, _rw, _rh);
+				return _transposed.data();
+			}
+			size_t rowstride = _carve_img.width();
+			for (size_t by = 0; by < _rh; by += _fused_block) {
+				size_t rows = _rh - by < _fused_block ? _rh - by : _fused_block;
+				for (size_t y = 0; y < rows; ++y) {
+					_calc_energy_row(by + y, _energy_rows.data() + y * rowstride);
+				}
+				transpose(_energy_rows.data(), rowstride, _transposed.data() + by, _rh, _rw, rows);
+			}
+			return _transposed.data();
+		}
+		// removes the seam from the DP table, then re-evaluates only the cells around it and the cone of cells
+		// whose predecessors changed value; data is in seam space and w is the width after removal. Under lazy
+		// compaction the rows of vertical seams keep their removed elements like the planes, and cells are read and
+		// written at their physical columns; the codes still hold offsets between pixels
+		void _carve_dp(orientation orient, const size_t *data) {
+			if (_compact_dp || !_fresh_dp || _dp_orientation != orient) {
+				_fresh_dp = false;
+				return;
+			}
+			size_t w = _rw, h = _rh, xstride = 1, ystride = _energy.width();
+			bool vertical = orient == orientation::vertical, lazy = vertical && _lazy_seams > 0;
+			if (!vertical) {
+				std::swap(w, h);
+				std::swap(xstride, ystride);
+			}
+			bool changed = false;
+			size_t cmin = 0, cmax = 0;
+			for (size_t y = 0; y < h; ++y) {
+				real_t *cur = _dp_row(y);
+				unsigned char *dir = _dp_dirs_row(y);
+				// under lazy compaction the seam was either recorded as removed or compacted away already
+				if (!lazy) {
+					std::memmove(cur + data[y], cur + data[y] + 1, sizeof(real_t) * (w - data[y]));
+					dp_kernel::erase_dir(dir, data[y], w);
+				}
 
-		inline static real_t _calc_energy_elem(
-			const color_rgba_r &left, const color_rgba_r &right,
-			const color_rgba_r &up, const color_rgba_r &down
-		) {
-			color_rgba_r hor = right - left, vert = up - down;
-			return std::sqrt(squared(hor.r) + squared(hor.g) + squared(hor.b) + squared(vert.r) + squared(vert.g) + squared(vert.b));
-		}
-#define ENERGY_FUNC 0
-#if ENERGY_FUNC == 0
-		void _calc_energy_row(
-			const color_rgba_r *l,
-			const color_rgba_r *u, const color_rgba_r *d,
-			real_t *cur
-		) {
-			const color_rgba_r *r = l + 1;
-			*cur = _calc_energy_elem(*l, *r, *u, *d);
-			++r, ++u, ++d, ++cur;
-			for (size_t x = 2; x < _rw; ++x, ++l, ++r, ++u, ++d, ++cur) {
-				*cur = _calc_energy_elem(*l, *r, *u, *d);
+				size_t xmin, xmax;
+				_get_seam_neighborhood(data, h, y, w, xmin, xmax);
+				if (changed) {
+					xmin = std::min(xmin, cmin > 0 ? cmin - 1 : 0);
+					xmax = std::max(xmax, std::min(cmax + 1, w - 1));
+				}
+				changed = false;
+				const real_t *energy = _fused_energy ? nullptr : _energy.data() + y * ystride;
+				// the predecessors of the cells, [lo, lo + len) of the row above
+				const real_t *last = nullptr;
+				size_t lo = xmin > 0 ? xmin - 1 : 0, len = std::min(xmax + 1, w - 1) - lo + 1;
+				if (y > 0) {
+					last = _dp_row(y - 1) + lo;
+					if (_removed_count > 0) {
+						_gather_dp_row(y - 1, lo, len);
+						last = _dp_gather.data();
+					}
+				}
+				// energies of vertical seams are read past the elements removed by lazy compaction; horizontal seams
+				// have compacted the rows
+				size_t removed = 0, col = vertical ? _physical_x(xmin, y, removed) : xmin;
+				for (size_t x = xmin; x <= xmax; ++x, col = vertical ? _next_physical_x(col, y, removed) : col + 1) {
+					real_t e = energy ? energy[col * xstride] : vertical ? _calc_energy_at(x, y) : _calc_energy_at(y, x);
+					real_t v = e;
+					signed char d = 0;
+					if (_transition_row) {
+						real_t step[3];
+						_calc_steps_at(orient, x, y, step);
+						if (last) {
+							dp_kernel::cell(last, e, step, x - lo, len, v, d);
+						} else {
+							v = e + step[1];
+						}
+					} else if (last) {
+						dp_kernel::cell(last, e, x - lo, len, v, d);
+					}
+					if (v != cur[col]) {
+						if (!changed) {
+							cmin = x;
+							changed = true;
+						}
+						cmax = x;
+					}
+					cur[col] = v;
+					dp_kernel::set_dir(dir, col, d);
+				}
+				_updated_cells += xmax - xmin + 1;
+			}
+		}
+		// copies the DP values of pixels [lo, lo + len) of row y, read past the removed elements, to _dp_gather
+		void _gather_dp_row(size_t y, size_t lo, size_t len) {
+			_dp_gather.resize(len);
+			const real_t *row = _dp_row(y);
+			const size_t *skip = _removed_row(y);
+			size_t removed, col = _physical_x(lo, y, removed);
+			for (size_t i = 0; i < len; ) {
+				size_t n = removed < _removed_count ? std::min(len - i, skip[removed] - col) : len - i;
+				std::memcpy(_dp_gather.data() + i, row + col, sizeof(real_t) * n);
+				i += n;
+				col = _next_physical_x(col + n - 1, y, removed);
+			}
+		}
+		// the transition costs of pixel (x, y) of seam space, gathered from the image like _calc_energy_at()
+		void _calc_steps_at(orientation orient, size_t x, size_t y, real_t *step) const {
+			bool vertical = orient == orientation::vertical;
+			size_t w = vertical ? _rw : _rh, lo = x > 0 ? x - 1 : 0, hi = x + 1 < w ? x + 1 : x;
+			size_t lines[2] = {y > 0 ? y - 1 : y, y};
+			component_t buf[2][3][3];
+			for (size_t r = 0; r < 2; ++r) {
+				size_t cols[3];
+				if (vertical) {
+					_physical_columns(lo, hi, lines[r], cols);
+				}
+				for (size_t c = 0; c < 3; ++c) {
+					for (size_t i = 0; i <= hi - lo; ++i) {
+						// horizontal seams run along the columns of the image
+						buf[r][c][i] = vertical ? _carve_img.row(c, lines[r])[cols[i]] :
+							_carve_img.row(c, lo + i)[lines[r]];
+					}
+				}
+			}
+			energy_rows<component_t> rows = {
+				{buf[0][0], buf[0][1], buf[0][2]}, {buf[1][0], buf[1][1], buf[1][2]}, {buf[1][0], buf[1][1], buf[1][2]}
+			};
+			real_t *costs[3] = {step, step + 1, step + 2};
+			_transition_row(rows, hi - lo + 1, costs, x - lo, x - lo + 1);
+		}
+		// the range of seam space columns in row y whose energy or predecessors are affected by the seam
+		static void _get_seam_neighborhood(const size_t *data, size_t h, size_t y, size_t w, size_t &xmin, size_t &xmax) {
+			xmin = xmax = data[y];
+			if (y > 0) {
+				xmin = std::min(xmin, data[y - 1]);
+				xmax = std::max(xmax, data[y - 1]);
+			}
+			if (y + 1 < h) {
+				xmin = std::min(xmin, data[y + 1]);
+				xmax = std::max(xmax, data[y + 1]);
+			}
+			xmin = xmin > 0 ? xmin - 1 : 0;
+			xmax = std::min(xmax + 1, w - 1);
+		}
+		// the full DP table is not maintained in pyramid mode, so the next exact search starts from scratch
+		void _get_pyramid_carve_path(orientation orient, size_t *path) {
+			_fresh_dp = false;
+			size_t stride;
+			const real_t *energy = _seam_energy(orient, stride);
+			if (orient == orientation::vertical) {
+				_updated_cells += _pyramid.find(energy, stride, _rw, _rh, path);
+			} else {
+				_updated_cells += _pyramid.find(energy, stride, _rh, _rw, path);
+			}
+		}
+		// backtracks the minimal seam from the w x h DP table into result
+		void _get_carve_path_impl(size_t w, size_t h, size_t *result) const {
+			// rows of vertical seams may still hold removed elements, see _carve_dp()
+			bool lazy = _removed_count > 0;
+			assert(!lazy || _dp_orientation == orientation::vertical);
+			const real_t *curv = _dp_row(h - 1);
+			size_t removed = 0, col = lazy ? _physical_x(0, h - 1, removed) : 0;
+			real_t minenergy = curv[col];
+			result[h - 1] = 0;
+			for (size_t i = 1; i < w; ++i) {
+				col = lazy ? _next_physical_x(col, h - 1, removed) : i;
+				if (curv[col] < minenergy) {
+					minenergy = curv[col];
+					result[h - 1] = i;
+				}
+			}
+			for (size_t y = h - 1, last = result[h - 1]; y > 0; ) {
+				last += dp_kernel::get_dir(_dp_dirs_row(y), lazy ? _physical_x(last, y) : last);
+				result[--y] = last;
+			}
+		}
+
+		energy_rows<component_t> _get_energy_rows(size_t y, size_t yu, size_t yd) const {
+			return {
+				{_carve_img.row(0, yu), _carve_img.row(1, yu), _carve_img.row(2, yu)},
+				{_carve_img.row(0, y), _carve_img.row(1, y), _carve_img.row(2, y)},
+				{_carve_img.row(0, yd), _carve_img.row(1, yd), _carve_img.row(2, yd)}
+			};
+		}
+		// the energies of columns [begin, end) of row y, with the neighbors yu and yd above and below
+		void _calc_energy_range(size_t y, size_t yu, size_t yd, real_t *dst, size_t begin, size_t end) const {
+			assert(_removed_count == 0);
+			_energy_row(_get_energy_rows(y, yu, yd), _mean, _rw, dst + begin, begin, end);
+		}
+		void _calc_energy_range(size_t y, real_t *dst, size_t begin, size_t end) const {
+			_calc_energy_range(y, y > 0 ? y - 1 : y, y + 1 < _rh ? y + 1 : y, dst, begin, end);
+		}
+		void _calc_energy_row(size_t y, size_t yu, size_t yd, real_t *dst) const {
+			_calc_energy_range(y, yu, yd, dst, 0, _rw);
+		}
+		void _calc_energy_row(size_t y, real_t *dst) const {
+			_calc_energy_range(y, dst, 0, _rw);
+		}
+		real_t _calc_energy_at(size_t x, size_t y) const {
+			real_t res;
+			size_t yu = y > 0 ? y - 1 : y, yd = y + 1 < _rh ? y + 1 : y;
+			if (_removed_count == 0) {
+				_energy_row(_get_energy_rows(y, yu, yd), _mean, _rw, &res, x, x + 1);
+				return res;
+			}
+			// removed elements may lie within the neighborhood, so its columns [lo, hi] are gathered first
+			size_t lo = x > 0 ? x - 1 : 0, hi = x + 1 < _rw ? x + 1 : x, rows[3] = {yu, y, yd};
+			component_t buf[3][3][3];
+			energy_rows<component_t> gathered;
+			for (size_t r = 0; r < 3; ++r) {
+				size_t cols[3];
+				_physical_columns(lo, hi, rows[r], cols);
+				for (size_t c = 0; c < 3; ++c) {
+					const component_t *src = _carve_img.row(c, rows[r]);
+					for (size_t i = 0; i <= hi - lo; ++i) {
+						buf[r][c][i] = src[cols[i]];
+					}
+				}
+			}
+			for (size_t c = 0; c < 3; ++c) {
+				gathered.up[c] = buf[0][c];
+				gathered.cur[c] = buf[1][c];
+				gathered.down[c] = buf[2][c];
+			}
+			_energy_row(gathered, _mean, hi - lo + 1, &res, x - lo, x - lo + 1);
+			return res;
+		}
+		// global energies change everywhere once the mean color moves: they are then recomputed and the DP has to
+		// start over. Until then the energies only move along with their pixels, like local ones
+		bool _update_global_energy() {
+			if (!_global_energy) {
+				return false;
+			}
+			const float tolerance =
+				_mean_tolerance * static_cast<float>(color_component_limits<component_t>::max) / 255.0f;
+			float mean[3];
+			bool moved = false;
+			for (size_t c = 0; c < 3; ++c) {
+				mean[c] = static_cast<float>(_color_sum[c] / static_cast<double>(_rw * _rh));
+				moved = moved || std::abs(mean[c] - _mean[c]) > tolerance;
+			}
+			if (!moved) {
+				return false;
+			}
+			std::copy(mean, mean + 3, _mean);
+			if (!_fused_energy) {
+				_calc_energy();
+			}
+			_fresh_dp = false;
+			return true;
+		}
+		// only the pixels next to the seam, or whose neighbors come from the other side of it, change
+		void _update_energy_vertical(const size_t *data) {
+			if (_update_global_energy() || _fused_energy) {
+				return;
+			}
+			for (size_t y = 0; y < _rh; ++y) {
+				size_t xmin, xmax;
+				_get_seam_neighborhood(data, _rh, y, _rw, xmin, xmax);
+				real_t *dst = _energy.at_y(y);
+				size_t removed, col = _physical_x(xmin, y, removed);
+				for (size_t x = xmin; x <= xmax; ++x, col = _next_physical_x(col, y, removed)) {
+					dst[col] = _calc_energy_at(x, y);
+				}
+			}
+		}
+		void _update_energy_horizontal(const size_t *data) {
+			if (_update_global_energy() || _fused_energy) {
+				return;
+			}
+			for (size_t x = 0; x < _rw; ++x) {
+				size_t ymin, ymax;
+				_get_seam_neighborhood(data, _rw, x, _rh, ymin, ymax);
+				for (size_t y = ymin; y <= ymax; ++y) {
+					_energy.at(x, y) = _calc_energy_at(x, y);
+				}
 			}
-			*cur = _calc_energy_elem(*l, *--r, *u, *d);
 		}
 		void _calc_energy() {
 			assert(_rh > 1 && _rw > 1);
-			_energy = dynamic_array2<real_t>(_rw, _rh);
-			_calc_energy_row(_carve_img[0], _carve_img[0], _carve_img[1], _energy[0]);
+			_compact();
+			_calc_energy_row(0, 0, 1, _energy[0]);
 			for (size_t y = 2; y < _rh; ++y) {
-				_calc_energy_row(_carve_img[y - 1], _carve_img[y - 2], _carve_img[y], _energy[y - 1]);
+				_calc_energy_row(y - 1, y - 2, y, _energy[y - 1]);
 			}
 			size_t y = _rh - 1;
-			_calc_energy_row(_carve_img[y], _carve_img[y - 1], _carve_img[y], _energy[y]);
+			_calc_energy_row(y, y - 1, y, _energy[y]);
+			_fresh_dp = false;
 		}
-#elif ENERGY_FUNC == 1
-		void _calc_energy() {
-			assert(_rh > 1 && _rw > 1);
-			_energy = dynamic_array2<real_t>(_rw, _rh);
-			color_rgba_f aveg;
-			for (size_t x = 0; x < _rw; ++x) {
+		void _calc_mean() {
+			for (size_t c = 0; c < 3; ++c) {
+				double sum = 0.0;
 				for (size_t y = 0; y < _rh; ++y) {
-					aveg += _carve_img.at(x, y);
+					const component_t *row = _carve_img.row(c, y);
+					for (size_t x = 0; x < _rw; ++x) {
+						sum += row[x];
+					}
 				}
+				_color_sum[c] = sum;
+				_mean[c] = static_cast<float>(sum / static_cast<double>(_rw * _rh));
+			}
+		}
+		// adds (sign = 1) or subtracts (sign = -1) the pixels of a seam that is in the image to the color sums
+		void _add_seam_colors(orientation orient, const size_t *data, double sign) {
+			if (!_global_energy) {
+				return;
 			}
-			aveg = aveg / (_rw * _rh);
+			bool vertical = orient == orientation::vertical;
+			size_t len = vertical ? _rh : _rw;
+			for (size_t c = 0; c < 3; ++c) {
+				double sum = 0.0;
+				for (size_t i = 0; i < len; ++i) {
+					sum += vertical ? _carve_img.row(c, i)[_physical_x(data[i], i)] : _carve_img.row(c, data[i])[i];
+				}
+				_color_sum[c] += sign * sum;
+			}
+		}
 
-			auto temp = aveg;
-			for (size_t x = 0; x < _rw; ++x) {
-				for (size_t y = 0; y < _rh; ++y) {
-					temp = aveg - _carve_img.at(x, y);
-					_energy.at(x, y) = sqrt(squared(temp.r) + squared(temp.g) + squared(temp.b));
+		// the column of pixel x of row y in the planes and the energy map. removed receives the number of removed
+		// elements before it, for _next_physical_x()
+		size_t _physical_x(size_t x, size_t y, size_t &removed) const {
+			const size_t *row = _removed_row(y);
+			for (removed = 0; removed < _removed_count && row[removed] <= x; ++removed) {
+				++x;
+			}
+			return x;
+		}
+		size_t _physical_x(size_t x, size_t y) const {
+			size_t removed;
+			return _physical_x(x, y, removed);
+		}
+		// the column of the pixel of row y after the one in column col
+		size_t _next_physical_x(size_t col, size_t y, size_t &removed) const {
+			const size_t *row = _removed_row(y);
+			for (++col; removed < _removed_count && row[removed] == col; ++removed) {
+				++col;
+			}
+			return col;
+		}
+		// the columns of pixels [lo, hi] of row y in the planes
+		void _physical_columns(size_t lo, size_t hi, size_t y, size_t *cols) const {
+			size_t removed;
+			cols[0] = _physical_x(lo, y, removed);
+			for (size_t x = lo + 1; x <= hi; ++x) {
+				cols[x - lo] = _next_physical_x(cols[x - lo - 1], y, removed);
+			}
+		}
+		const size_t *_removed_row(size_t y) const {
+			return _removed.data() + y * _lazy_seams;
+		}
+		void _add_removed(size_t y, size_t column) {
+			size_t *removed = _removed.data() + y * _lazy_seams, i = _removed_count;
+			for (; i > 0 && removed[i - 1] > column; --i) {
+				removed[i] = removed[i - 1];
+			}
+			removed[i] = column;
+		}
+		// moves the pixels, energies and DP cells between removed elements to the left, so that every row of the
+		// planes, the energy map and the DP table is contiguous again
+		void _compact() {
+			if (_removed_count == 0) {
+				return;
+			}
+			// the table only holds removed elements while it is kept up to date for vertical seams
+			bool dp = _fresh_dp && !_compact_dp && _dp_orientation == orientation::vertical;
+			for (size_t y = 0; y < _rh; ++y) {
+				for (size_t c = 0; c < _carve_img.planes(); ++c) {
+					_compact_row(_carve_img.row(c, y), y);
+				}
+				if (!_fused_energy) {
+					_compact_row(_energy.at_y(y), y);
+				}
+				if (dp) {
+					_compact_row(_dp_row(y), y);
+					_compact_codes(_dp_dirs_row(y), y);
 				}
 			}
+			_removed_count = 0;
+		}
+		void _compact_codes(unsigned char *codes, size_t y) const {
+			const size_t *removed = _removed_row(y);
+			for (size_t i = 0; i < _removed_count; ++i) {
+				size_t end = i + 1 < _removed_count ? removed[i + 1] : _rw + _removed_count;
+				dp_kernel::move_codes(codes, removed[i] + 1, end, i + 1);
+			}
+		}
+		template <typename T> void _compact_row(T *row, size_t y) const {
+			const size_t *removed = _removed_row(y);
+			T *dst = row + removed[0];
+			for (size_t i = 0; i < _removed_count; ++i) {
+				size_t begin = removed[i] + 1, end = i + 1 < _removed_count ? removed[i + 1] : _rw + _removed_count;
+				std::memmove(dst, row + begin, sizeof(T) * (end - begin));
+				dst += end - begin;
+			}
+		}
+		template <typename Color> void _get_current_image(image<Color> &img) const {
+			planar_cast(
+				_carve_img, _rw, _rh, _removed_count > 0 ? _removed.data() : nullptr, _lazy_seams, _removed_count, img
+			);
 		}
-#endif
 	};
+	using simple_retargeter = basic_simple_retargeter<float_carving_traits>;
+	using simple_retargeter_u8 = basic_simple_retargeter<u8_carving_traits>;
 }
@@ -1,92 +1,101 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
 
 #include "image.h"
+#include "thread_pool.h"
+#include "energy.h"
 
-//#define USE_INDEX_PTR
 #define USE_INCREMENTAL
 
 namespace seam_carving {
 	class dancing_link_retargeter {
 	public:
-		struct node;
-#ifdef USE_INDEX_PTR
-		using ptr_t = size_t;
-		using const_ptr_t = size_t;
-		constexpr static ptr_t null = -1;
-#else
-		using ptr_t = node * ;
-		using const_ptr_t = const node*;
-		constexpr static ptr_t null = nullptr;
-#endif
+		// nodes are 32-bit indices into the node arrays, which start out laid out like the pixels of the image
+		using ptr_t = std::uint32_t;
+		using const_ptr_t = std::uint32_t;
+		constexpr static ptr_t null = std::numeric_limits<ptr_t>::max();
 
 		using real_t = float;
 		using color_t = color_rgba_u8;
 		using enlarge_table_t = std::vector<std::vector<std::pair<size_t, size_t>>>;
+		using enlarge_rank_t = std::uint16_t;
+		// the same seams as enlarge_table_t stored as one 16-bit seam number per pixel of the original image, an
+		// eighth of the size. Enlarging by k duplicates every pixel whose rank is below k; pixels of seams past the
+		// 65535th keep the maximum rank and are never duplicated
+		struct compact_enlarge_view {
+			orientation orient;
+			size_t width, height, seams;
+			const enlarge_rank_t *ranks;
+		};
+		struct compact_enlarge_table {
+			orientation orient = orientation::horizontal;
+			size_t width = 0, height = 0, seams = 0;
+			std::vector<enlarge_rank_t> ranks;
 
-		struct node {
-			real_t energy, dp, compensation = 0.0;
-			color_t color;
-			ptr_t left = null, up = null, right = null, down = null, path_ptr = null;
+			compact_enlarge_view view() const {
+				return {orient, width, height, seams, ranks.data()};
+			}
+		};
+
+		// the current neighbors of a node, null at the borders. Links, DP values and colors are kept in separate
+		// arrays, so that DP sweeps only go through the links and the DP values
+		struct node_links {
+			ptr_t left, up, right, down;
 		};
 		struct keep_original {
-			inline static color_rgba_u8 process(const node &n) {
-				return n.color;
+			inline static color_rgba_u8 process(const color_t &color, real_t) {
+				return color;
 			}
 		};
 		struct blend_compensation {
-			inline static color_rgba_u8 process(const node &n) {
-				if (n.compensation < 1e-6) {
+			inline static color_rgba_u8 process(const color_t &color, real_t compensation) {
+				if (compensation < 1e-6) {
 					return color_rgba_u8::blend(color_rgba_u8(
-						0, 255, 0, static_cast<unsigned char>(127 * (1.0 - std::exp(n.compensation)))
-					), n.color);
-				} else if (n.compensation > 1e-6) {
+						0, 255, 0, static_cast<unsigned char>(127 * (1.0 - std::exp(compensation)))
+					), color);
+				} else if (compensation > 1e-6) {
 					return color_rgba_u8::blend(color_rgba_u8(
-						255, 0, 0, static_cast<unsigned char>(127 * (1.0 - std::exp(-n.compensation)))
-					), n.color);
+						255, 0, 0, static_cast<unsigned char>(127 * (1.0 - std::exp(-compensation)))
+					), color);
 				}
-				return n.color;
+				return color;
 			}
 		};
 
 		void set_image(const image_rgba_u8 &img) {
-			_w = img.width();
-			_h = img.height();
+			size_t w = img.width(), h = img.height();
+			assert(w * h < null);
+			_w = w;
+			_h = h;
 			_cps.clear();
-			_n = std::vector<node>(img.width() * img.height(), node());
-			_tl = _pref(_n[0]);
-			_br = _pref(_n.back());
-			const color_rgba_u8 *color = img.at_y(0);
-			_pderef(_tl).color = *color;
-			ptr_t cur = _pref(_n[1]), last = _pref(_n[0]);
-			for (size_t x = 1; x < img.width(); ++x, last = cur, cur = _pref(_pderef(cur + 1))) {
-				_pderef(cur).color = *++color;
-				_pderef(cur).left = last;
-				_pderef(last).right = cur;
-			}
-			cur = _pref(_n[0]), last = cur;
-			for (size_t y = 1; y < img.height(); ++y, last = cur) {
-				cur = _pref(_pderef(cur + img.width()));
-				color = img.at_y(y);
-				_pderef(cur).color = *color;
-				_pderef(cur).up = last;
-				_pderef(last).down = cur;
-				ptr_t curx = cur, lastx = cur;
-				for (size_t x = 1; x < img.width(); ++x, lastx = curx) {
-					curx = _pref(_pderef(curx + 1));
-					_pderef(curx).color = *++color;
-					_pderef(curx).left = lastx;
-					_pderef(lastx).right = curx;
-					ptr_t up = _pref(_pderef(curx - img.width()));
-					_pderef(curx).up = up;
-					_pderef(up).down = curx;
-				}
-			}
-			// calculate energy
-			for (size_t i = 0; i < _n.size(); ++i) {
-				_calc_energy_elem(_pref(_n[i]));
+			_ln.resize(w * h);
+			// the costs are kept in the values of vertical seams; those of horizontal seams are copied on first use
+			_dps[static_cast<size_t>(orientation::vertical)].nodes.resize(w * h);
+			_dps[static_cast<size_t>(orientation::horizontal)].nodes.clear();
+			_colors.assign(img.data(), img.data() + w * h);
+			_compensation.clear();
+			_origin.clear();
+			_carves_since_compact = 0;
+			_invalidate_dp();
+			_tl = 0;
+			_br = static_cast<ptr_t>(w * h - 1);
+			_row_heads.resize(h);
+			for (size_t y = 0; y < h; ++y) {
+				_row_heads[y] = static_cast<ptr_t>(y * w);
+			}
+			_col_heads.resize(w);
+			for (size_t x = 0; x < w; ++x) {
+				_col_heads[x] = static_cast<ptr_t>(x);
 			}
+			_row_major = true;
+			if (_global_energy) {
+				_calc_mean();
+			}
+			_calc_rows(true);
 		}
 		template <typename ColorProc = keep_original> image_rgba_u8 get_image() const {
 			image_rgba_u8 res(_w, _h);
@@ -100,36 +109,104 @@ namespace seam_carving {
 		}
 
 		void invalidate_dp_values() {
-			_fresh_dp = false;
+			_invalidate_dp();
+		}
+		// like invalidate_dp_values(), for changes confined to the nodes in [xmin, xmax) x [ymin, ymax) of the current
+		// grid. The next seam of either orientation only recomputes the DP values that depend on these nodes
+		void invalidate_dp_region(size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+			xmax = std::min(xmax, _w);
+			ymax = std::min(ymax, _h);
+			if (xmin >= xmax || ymin >= ymax) {
+				return;
+			}
+			for (_dp_state &s : _dps) {
+				if (!s.fresh) {
+					continue;
+				}
+				if (s.dirty) {
+					s.dirty_min[0] = std::min(s.dirty_min[0], xmin);
+					s.dirty_min[1] = std::min(s.dirty_min[1], ymin);
+					s.dirty_max[0] = std::max(s.dirty_max[0], xmax);
+					s.dirty_max[1] = std::max(s.dirty_max[1], ymax);
+				} else {
+					s.dirty_min[0] = xmin;
+					s.dirty_min[1] = ymin;
+					s.dirty_max[0] = xmax;
+					s.dirty_max[1] = ymax;
+					s.dirty = true;
+				}
+			}
+		}
+		// switches the energy function; the energies are recomputed right away. The default is the squared gradient
+		void set_energy(energy_type type) {
+			_energy_type = type;
+			_energy_func = select_energy<_energy_selector>(type);
+			_energy_row = select_energy<_energy_row_selector>(type);
+			energy_properties props = get_energy_properties(type);
+			_global_energy = props.global;
+			_diagonal_energy = props.diagonals;
+			_dps[static_cast<size_t>(orientation::vertical)].step_costs =
+				select_energy<_steps_selector<&node_links::left, &node_links::right, &node_links::down>>(type);
+			_dps[static_cast<size_t>(orientation::horizontal)].step_costs =
+				select_energy<_steps_selector<&node_links::up, &node_links::down, &node_links::right>>(type);
+			if (_tl != null) {
+				_calc_all_energy();
+			}
+			_invalidate_dp();
+		}
+		energy_type get_energy() const {
+			return _energy_type;
+		}
+		// global energies are only recomputed once the mean color has moved by more than this many levels in some
+		// channel since they were last computed; 0 recomputes them whenever it changes at all
+		void set_mean_tolerance(float levels) {
+			_mean_tolerance = levels;
+		}
+		float get_mean_tolerance() const {
+			return _mean_tolerance;
+		}
+		// full DP sweeps over rows at least min_width nodes long are split between this many threads, and so is
+		// set_image() for images that wide; 0 uses all hardware threads and 1 keeps them serial. Seams are identical
+		// either way
+		void set_dp_threads(size_t threads, size_t min_width = parallel_dp::default_min_width) {
+			_parallel.set_threads(threads, min_width);
+		}
+		size_t get_dp_threads() const {
+			return _parallel.get_threads();
+		}
+		// calls compact() after every this many carved seams; 0 never compacts automatically
+		void set_auto_compaction(size_t seams) {
+			_compact_interval = seams;
+		}
+		size_t get_auto_compaction() const {
+			return _compact_interval;
 		}
 
 		ptr_t get_vertical_carve_path() {
-			_update_dp<&node::left, &node::right, &node::up, &node::down>(orientation::vertical);
-			return _get_carve_path_impl<&node::left, &node::right, &node::up, &node::down>();
+			_update_dp<&node_links::left, &node_links::right, &node_links::up, &node_links::down>();
+			return _get_carve_path_impl<&node_links::left, &node_links::right, &node_links::up, &node_links::down>();
 		}
 		void carve_path_vertical(ptr_t ptr) {
-			_carve_path_impl<&node::left, &node::right, &node::up, &node::down>(ptr);
+			_carve_path_impl<&node_links::left, &node_links::right, &node_links::up, &node_links::down>(ptr);
 			_cps.push_back({ptr, orientation::vertical});
-			--_w;
+			_auto_compact();
 		}
 		ptr_t get_horizontal_carve_path() {
-			_update_dp<&node::up, &node::down, &node::left, &node::right>(orientation::horizontal);
-			return _get_carve_path_impl<&node::up, &node::down, &node::left, &node::right>();
+			_update_dp<&node_links::up, &node_links::down, &node_links::left, &node_links::right>();
+			return _get_carve_path_impl<&node_links::up, &node_links::down, &node_links::left, &node_links::right>();
 		}
 		void carve_path_horizontal(ptr_t ptr) {
-			_carve_path_impl<&node::up, &node::down, &node::left, &node::right>(ptr);
+			_carve_path_impl<&node_links::up, &node_links::down, &node_links::left, &node_links::right>(ptr);
 			_cps.push_back({ptr, orientation::horizontal});
-			--_h;
+			_auto_compact();
 		}
 		void restore_path() {
 			switch (_cps.back().second) {
 			case orientation::horizontal:
-				_restore_path_impl<&node::up, &node::down>(_cps.back().first);
-				++_h;
+				_restore_path_impl<&node_links::up, &node_links::down, &node_links::left, &node_links::right>(_cps.back().first);
 				break;
 			case orientation::vertical:
-				_restore_path_impl<&node::left, &node::right>(_cps.back().first);
-				++_w;
+				_restore_path_impl<&node_links::left, &node_links::right, &node_links::up, &node_links::down>(_cps.back().first);
 				break;
 			}
 			_cps.pop_back();
@@ -146,6 +223,7 @@ namespace seam_carving {
 					}
 				} while (width < _w || height < _h);
 			} else {
+				_count_restores_ahead(width, height);
 				while (_cps.size() > 0) {
 					if (_cps.back().second == orientation::horizontal) {
 						if (_h >= height) {
@@ -158,48 +236,132 @@ namespace seam_carving {
 					}
 					restore_path();
 				}
+				for (_dp_state &s : _dps) {
+					s.restores_ahead = 0;
+				}
+			}
+		}
+
+		// carving leaves the remaining nodes scattered through the arrays, so that walking a row jumps around in
+		// memory. This renumbers the nodes so that the current grid is stored row by row, followed by the carved
+		// nodes in their previous order. Pointers obtained before are invalidated; carved seams can still be restored
+		void compact() {
+			_carves_since_compact = 0;
+			if (_tl == null) {
+				return;
+			}
+			// new index -> old index and back. Carved nodes are only reached through the seams, one per row, so
+			// they are not gathered seam by seam
+			std::vector<ptr_t> order, remap(_ln.size(), static_cast<ptr_t>(null));
+			order.reserve(_ln.size());
+			for (ptr_t y = _tl; y != null; y = _ln[y].down) {
+				for (ptr_t x = y; x != null; x = _ln[x].right) {
+					remap[x] = static_cast<ptr_t>(order.size());
+					order.push_back(x);
+				}
+			}
+			for (size_t i = 0; i < remap.size(); ++i) {
+				if (remap[i] == null) {
+					remap[i] = static_cast<ptr_t>(order.size());
+					order.push_back(static_cast<ptr_t>(i));
+				}
+			}
+			auto map = [&remap](ptr_t p) -> ptr_t {
+				return p == null ? p : remap[p];
+			};
+			_permute(_ln, order, [&map](const node_links &l) {
+				return node_links{map(l.left), map(l.up), map(l.right), map(l.down)};
+			});
+			for (_dp_state &s : _dps) {
+				_permute(s.nodes, order, [&map](const _dp_node &d) {
+					return _dp_node{d.cost, d.dp, map(d.path_ptr)};
+				});
+				s.pending = map(s.pending);
+			}
+			_permute(_colors, order, _identity());
+			_permute(_compensation, order, _identity());
+			if (_origin.empty()) {
+				_origin.swap(order);
+			} else {
+				_permute(_origin, order, _identity());
+			}
+			for (auto &cp : _cps) {
+				cp.first = map(cp.first);
+			}
+			_tl = map(_tl);
+			_br = map(_br);
+			for (ptr_t &p : _row_heads) {
+				p = map(p);
 			}
+			for (ptr_t &p : _col_heads) {
+				p = map(p);
+			}
+			_row_major = true;
 		}
 
 		void validate_graph_structure() { // TODO right & bottom boundary check
-			assert(_pderef(_tl).left == null && _pderef(_tl).up == null);
+			assert(_ln[_tl].left == null && _ln[_tl].up == null);
+			assert(_row_heads.size() == _h && _col_heads.size() == _w && _row_heads[0] == _tl && _col_heads[0] == _tl);
 			size_t xn = 1;
-			for (ptr_t x = _pderef(_tl).right; x != null; x = _pderef(x).right, ++xn) {
-				assert(_pderef(x).up == null);
-				assert(_pderef(_pderef(x).left).right == x);
+			for (ptr_t x = _ln[_tl].right; x != null; x = _ln[x].right, ++xn) {
+				assert(_ln[x].up == null);
+				assert(_col_heads[xn] == x);
+				assert(_ln[_ln[x].left].right == x);
 			}
 			assert(xn == _w);
 			size_t yn = 1;
-			for (ptr_t y = _pderef(_tl).down; y != null; y = _pderef(y).down, ++yn) {
+			for (ptr_t y = _ln[_tl].down; y != null; y = _ln[y].down, ++yn) {
 				xn = 1;
-				assert(_pderef(y).left == null);
-				assert(_pderef(_pderef(y).up).down == y);
-				for (ptr_t x = _pderef(y).right; x != null; x = _pderef(x).right, ++xn) {
-					assert(_pderef(_pderef(x).left).right == x);
-					assert(_pderef(_pderef(x).up).down == x);
+				assert(_ln[y].left == null);
+				assert(_row_heads[yn] == y);
+				assert(_ln[_ln[y].up].down == y);
+				for (ptr_t x = _ln[y].right; x != null; x = _ln[x].right, ++xn) {
+					assert(_ln[_ln[x].left].right == x);
+					assert(_ln[_ln[x].up].down == x);
 				}
 				assert(xn == _w);
 			}
 			assert(yn == _h);
 		}
 
+		// the first node of a row is looked up in O(1). Other nodes are found in O(1) right after set_image() and
+		// compact(), and by walking along the shorter of their row and column otherwise
 		const_ptr_t at_y(size_t y) const {
-			return _pfrompos(_at_y_impl(y));
+			return _at_y_impl(y);
 		}
 		const_ptr_t at(size_t x, size_t y) const {
-			return _pfrompos(_at_impl(x, y));
+			return _at_impl(x, y);
 		}
 		ptr_t at_y(size_t y) {
-			return _pfrompos(_at_y_impl(y));
+			return _at_y_impl(y);
 		}
 		ptr_t at(size_t x, size_t y) {
-			return _pfrompos(_at_impl(x, y));
+			return _at_impl(x, y);
+		}
+		const node_links &get_links(ptr_t p) const {
+			return _ln[p];
 		}
-		node &deref(ptr_t p) {
-			return _pderef(p);
+		const color_t &get_color(ptr_t p) const {
+			return _colors[p];
 		}
-		const node &deref(ptr_t p) const {
-			return _pderef(p);
+		// the energy of a node with its current neighbors, without the compensation
+		real_t get_node_energy(ptr_t p) const {
+			return _energy_func(*this, p);
+		}
+		real_t get_compensation(ptr_t p) const {
+			return _compensation.empty() ? 0.0f : _compensation[p];
+		}
+		// an extra cost for removing the node: positive values protect it, negative ones make seams go through it.
+		// Call invalidate_dp_values() or invalidate_dp_region() after changing compensations
+		void set_compensation(ptr_t p, real_t v) {
+			if (_compensation.empty()) {
+				if (v == 0.0f) {
+					return;
+				}
+				_compensation.assign(_ln.size(), 0.0f);
+			}
+			_compensation[p] = v;
+			_calc_energy_elem(p);
 		}
 
 		size_t get_updated_node_count() const {
@@ -220,42 +382,346 @@ namespace seam_carving {
 		}
 
 		enlarge_table_t prepare_horizontal_enlarging() {
-			return _prepare_enlarging_impl<&node::left, &node::right, &node::up, &node::down>(_w, _h, orientation::horizontal);
+			return _prepare_enlarging_table<&node_links::left, &node_links::right, &node_links::up, &node_links::down>(_w, _h, orientation::horizontal);
 		}
 		enlarge_table_t prepare_vertical_enlarging() {
-			return _prepare_enlarging_impl<&node::up, &node::down, &node::left, &node::right>(_h, _w, orientation::vertical);
+			return _prepare_enlarging_table<&node_links::up, &node_links::down, &node_links::left, &node_links::right>(_h, _w, orientation::vertical);
+		}
+		compact_enlarge_table prepare_horizontal_enlarging_compact() {
+			return _prepare_enlarging_compact<&node_links::left, &node_links::right, &node_links::up, &node_links::down>(_w, orientation::horizontal);
+		}
+		compact_enlarge_table prepare_vertical_enlarging_compact() {
+			return _prepare_enlarging_compact<&node_links::up, &node_links::down, &node_links::left, &node_links::right>(_h, orientation::vertical);
+		}
+		// writes img enlarged by the first seams of table to out, which must already have the enlarged size. No
+		// row (horizontal) or column (vertical) gets more than seams duplicates, even from a corrupt table
+		template <typename Img> inline static void enlarge_with_table(
+			const image_rgba_u8 &img, const compact_enlarge_table &table, size_t seams, Img &out
+		) {
+			enlarge_with_table(img, table.view(), seams, out);
+		}
+		template <typename Img> inline static void enlarge_with_table(
+			const image_rgba_u8 &img, const compact_enlarge_view &table, size_t seams, Img &out
+		) {
+			assert(img.width() == table.width && img.height() == table.height && seams <= table.seams);
+			enlarge_rank_t limit = static_cast<enlarge_rank_t>(seams);
+			if (table.orient == orientation::horizontal) {
+				for (size_t y = 0; y < table.height; ++y) {
+					const color_rgba_u8 *src = img.at_y(y);
+					const enlarge_rank_t *rank = table.ranks + y * table.width;
+					typename Img::element_type *dst = out.at_y(y);
+					size_t duplicated = 0;
+					for (size_t x = 0; x < table.width; ++x) {
+						*dst = typename Img::element_type(src[x]);
+						if (rank[x] < limit && duplicated < seams) {
+							dst[1] = dst[0];
+							++dst;
+							++duplicated;
+						}
+						++dst;
+					}
+				}
+			} else {
+				// rows are read in order; each column keeps its own output row
+				std::vector<size_t> dy(table.width, 0);
+				for (size_t y = 0; y < table.height; ++y) {
+					const color_rgba_u8 *src = img.at_y(y);
+					const enlarge_rank_t *rank = table.ranks + y * table.width;
+					for (size_t x = 0; x < table.width; ++x) {
+						typename Img::element_type c(src[x]);
+						out.at(x, dy[x]++) = c;
+						if (rank[x] < limit && dy[x] <= y + seams) {
+							out.at(x, dy[x]++) = c;
+						}
+					}
+				}
+			}
 		}
 
 		void clear() {
-			_n.clear();
+			_ln.clear();
+			for (_dp_state &s : _dps) {
+				s.nodes.clear();
+			}
+			_colors.clear();
+			_compensation.clear();
+			_origin.clear();
+			_row_heads.clear();
+			_col_heads.clear();
 			_tl = _br = null;
 		}
 	protected:
-		void _calc_energy_elem(ptr_t nptr) {
-			node &n = _pderef(nptr);
-			color_t
-				lc = n.left == null ? n.color : _pderef(n.left).color, rc = n.right == null ? n.color : _pderef(n.right).color,
-				uc = n.up == null ? n.color : _pderef(n.up).color, dc = n.down == null ? n.color : _pderef(n.down).color;
-			color_rgba_f hd = rc.cast<float>() - lc.cast<float>(), vd = dc.cast<float>() - uc.cast<float>();
-			n.energy = squared(hd.r) + squared(hd.g) + squared(hd.b) + squared(vd.r) + squared(vd.g) + squared(vd.b);
+		// DP state of a node; cost is its energy plus its compensation, which is all the DP reads
+		struct _dp_node {
+			real_t cost, dp;
+			ptr_t path_ptr;
+		};
+		// the DP values of the seams of one orientation. Both are kept up to date incrementally while seams of both
+		// orientations are being looked up, so that alternating seams do not recompute the whole grid
+		struct _dp_state {
+			std::vector<_dp_node> nodes;
+			// fresh values match the grid, apart from the pending seam and the dirty rectangle. used tells whether
+			// a seam has been looked up since the values were last kept up to date across a seam of the other
+			// orientation, which is only worth it while both orientations are in use
+			bool fresh = false, used = false, dirty = false;
+			// a seam found with these values and carved since, which they still have to be updated for
+			ptr_t pending = null;
+			// the cost of the updates for restored seams since the last lookup and of the last one, in nodes of a
+			// full sweep, and the number of seams of this orientation that retarget() is still going to restore
+			size_t restore_work = 0, restore_cost = 0, restores_ahead = 0;
+			// the rectangle of the grid whose costs have changed since, x first
+			size_t dirty_min[2], dirty_max[2];
+			// the transition costs of the energy along these lines, nullptr for energies without them
+			void (*step_costs)(const dancing_link_retargeter&, ptr_t, real_t*) = nullptr;
+		};
+
+		// the neighbor in direction dir, or p itself at the border
+		ptr_t _step(ptr_t p, ptr_t node_links::*dir) const {
+			return _ln[p].*dir == null ? p : _ln[p].*dir;
 		}
+		// reads the neighborhood of a node for the energy policies. Colors are normalized to [0, 1] as they always
+		// have been, so that energies keep their scale for compensations and seams stay the same
+		struct _node_sampler {
+			const dancing_link_retargeter &carver;
+			ptr_t center;
 
-		template <ptr_t node::*XN, ptr_t node::*XP> void _detach_elem(ptr_t elem) {
-			node &en = _pderef(elem);
+			inline ptr_t at(int dx, int dy) const {
+				ptr_t row = dy < 0 ? carver._step(center, &node_links::up) : (dy > 0 ? carver._step(center, &node_links::down) : center);
+				return dx < 0 ? carver._step(row, &node_links::left) : (dx > 0 ? carver._step(row, &node_links::right) : row);
+			}
+			inline float operator()(int c, int dx, int dy) const {
+				const color_t &col = carver._colors[at(dx, dy)];
+				return cast_color_component<float>(c == 0 ? col.r : (c == 1 ? col.g : col.b));
+			}
+			inline float mean(int c) const {
+				return carver._unit_mean[c];
+			}
+		};
+		// reads the neighborhood of a node for transition costs, in the seam space of the lines along XN and XP:
+		// dy < 0 is the line before towards YP
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP> struct _line_sampler {
+			const dancing_link_retargeter &carver;
+			ptr_t center;
+
+			inline float operator()(int c, int dx, int dy) const {
+				ptr_t line = dy < 0 ? carver._step(center, YP) : center;
+				line = dx < 0 ? carver._step(line, XN) : (dx > 0 ? carver._step(line, XP) : line);
+				const color_t &col = carver._colors[line];
+				return cast_color_component<float>(c == 0 ? col.r : (c == 1 ? col.g : col.b));
+			}
+			inline float mean(int c) const {
+				return carver._unit_mean[c];
+			}
+		};
+		template <
+			typename Policy, ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP
+		> inline static void _calc_steps_policy(const dancing_link_retargeter &carver, ptr_t p, real_t *steps) {
+			transition_costs_of<Policy>::template get<real_t>(_line_sampler<XN, XP, YP>{carver, p}, steps);
+		}
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP> struct _steps_selector {
+			using result_type = void (*)(const dancing_link_retargeter&, ptr_t, real_t*);
+
+			template <typename Policy> inline static result_type get() {
+				return Policy::transitions ? &_calc_steps_policy<Policy, XN, XP, YP> : nullptr;
+			}
+		};
+		template <typename Policy> inline static real_t _calc_energy_policy(const dancing_link_retargeter &carver, ptr_t p) {
+			return Policy::template evaluate<real_t>(_node_sampler{carver, p});
+		}
+		struct _energy_selector {
+			using result_type = real_t (*)(const dancing_link_retargeter&, ptr_t);
+
+			template <typename Policy> inline static result_type get() {
+				return &_calc_energy_policy<Policy>;
+			}
+		};
+		struct _energy_row_selector {
+			using result_type = void (*)(const energy_rows<float>&, const float*, size_t, real_t*, size_t, size_t);
+
+			template <typename Policy> inline static result_type get() {
+				return &energy_row<Policy, real_t, float>;
+			}
+		};
+		void _calc_energy_elem(ptr_t p) {
+			real_t cost = _energy_func(*this, p) + get_compensation(p);
+			for (_dp_state &s : _dps) {
+				if (!s.nodes.empty()) {
+					s.nodes[p].cost = cost;
+				}
+			}
+		}
+		// recomputes the color sums and the mean color of the current grid if the energy needs them, then all energies
+		void _calc_all_energy() {
+			if (_global_energy) {
+				_calc_mean();
+			}
+			if (_row_major) {
+				_calc_rows(false);
+			} else {
+				_calc_energies();
+			}
+		}
+		void _calc_mean() {
+			// the sums of integers are exact, whatever order they are added in
+			std::uint64_t sum[3] = {0, 0, 0};
+			auto add = [&sum](const color_t &c) {
+				sum[0] += c.r;
+				sum[1] += c.g;
+				sum[2] += c.b;
+			};
+			_color_count = 0;
+			if (_row_major) {
+				_color_count = _w * _h;
+				for (size_t i = 0; i < _color_count; ++i) {
+					add(_colors[i]);
+				}
+			} else {
+				for (ptr_t y = _tl; y != null; y = _ln[y].down) {
+					for (ptr_t x = y; x != null; x = _ln[x].right, ++_color_count) {
+						add(_colors[x]);
+					}
+				}
+			}
+			float mean[3];
+			for (size_t c = 0; c < 3; ++c) {
+				_color_sum[c] = static_cast<double>(sum[c]);
+				mean[c] = static_cast<float>(_color_sum[c] / static_cast<double>(_color_count));
+			}
+			_set_mean(mean);
+		}
+		// the mean is kept in levels for the tolerance, and normalized like the colors for the energies
+		void _set_mean(const float *mean) {
+			for (size_t c = 0; c < 3; ++c) {
+				_mean[c] = mean[c];
+				_unit_mean[c] = mean[c] / 255;
+			}
+		}
+		// computes all energies of a grid that is stored row by row from index 0, and links its nodes first if
+		// link is set. Rows are split into bands for the threads of full DP sweeps
+		void _calc_rows(bool link) {
+			size_t h = _h;
+			if (_parallel.enabled_for(_w)) {
+				_parallel.run([&](size_t t, size_t n, spin_barrier&) {
+					_calc_row_band(parallel_dp::chunk_begin(t, n, h), parallel_dp::chunk_begin(t + 1, n, h), link);
+				});
+			} else {
+				_calc_row_band(0, h, link);
+			}
+		}
+		// rows [begin, end) of _calc_rows(). Three rows of colors at a time are split into normalized red, green and
+		// blue planes for the row kernels of the energy policies, which give the same energies as the node sampler
+		void _calc_row_band(size_t begin, size_t end, bool link) {
+			size_t w = _w, h = _h;
+			if (begin >= end) {
+				return;
+			}
+			std::vector<float> planes(9 * w);
+			std::vector<real_t> energy(w);
+			auto row_planes = [&planes, w](size_t y) {
+				return planes.data() + (y % 3) * 3 * w;
+			};
+			auto split = [&](size_t y) {
+				float *dst = row_planes(y);
+				const color_t *src = _colors.data() + y * w;
+				for (size_t x = 0; x < w; ++x) {
+					dst[x] = cast_color_component<float>(src[x].r);
+					dst[w + x] = cast_color_component<float>(src[x].g);
+					dst[2 * w + x] = cast_color_component<float>(src[x].b);
+				}
+			};
+			if (begin > 0) {
+				split(begin - 1);
+			}
+			split(begin);
+			for (size_t y = begin; y < end; ++y) {
+				if (y + 1 < h) {
+					split(y + 1);
+				}
+				const float
+					*up = row_planes(y > 0 ? y - 1 : y), *cur = row_planes(y), *down = row_planes(y + 1 < h ? y + 1 : y);
+				energy_rows<float> rows = {
+					{up, up + w, up + 2 * w}, {cur, cur + w, cur + 2 * w}, {down, down + w, down + 2 * w}
+				};
+				_energy_row(rows, _unit_mean, w, energy.data(), 0, w);
+				ptr_t first = static_cast<ptr_t>(y * w);
+				if (!_compensation.empty()) {
+					for (size_t x = 0; x < w; ++x) {
+						energy[x] += _compensation[first + x];
+					}
+				}
+				if (link) {
+					ptr_t vstep = static_cast<ptr_t>(w);
+					bool has_up = y > 0, has_down = y + 1 < h;
+					for (ptr_t i = first, last = static_cast<ptr_t>(first + w); i < last; ++i) {
+						_ln[i] = {i - 1, has_up ? i - vstep : null, i + 1, has_down ? i + vstep : null};
+					}
+					_ln[first].left = null;
+					_ln[first + w - 1].right = null;
+				}
+				for (_dp_state &s : _dps) {
+					if (s.nodes.empty()) {
+						continue;
+					}
+					_dp_node *nodes = s.nodes.data() + first;
+					if (link) {
+						for (size_t x = 0; x < w; ++x) {
+							nodes[x] = _dp_node{energy[x], 0.0f, null};
+						}
+					} else {
+						for (size_t x = 0; x < w; ++x) {
+							nodes[x].cost = energy[x];
+						}
+					}
+				}
+			}
+		}
+		void _calc_energies() {
+			for (ptr_t y = _tl; y != null; y = _ln[y].down) {
+				for (ptr_t x = y; x != null; x = _ln[x].right) {
+					_calc_energy_elem(x);
+				}
+			}
+		}
+		void _add_color(const color_t &c, double sign) {
+			_color_sum[0] += sign * c.r;
+			_color_sum[1] += sign * c.g;
+			_color_sum[2] += sign * c.b;
+		}
+		// takes the pixels of a seam out of (sign = -1) or back into (sign = 1) the color sums and tells whether the
+		// mean color has moved beyond the tolerance since the energies were computed, in which case it is updated
+		bool _update_mean(const std::vector<_dp_node> &dn, ptr_t head, double sign) {
+			for (ptr_t cur = head; cur != null; cur = dn[cur].path_ptr) {
+				_add_color(_colors[cur], sign);
+				_color_count = sign > 0.0 ? _color_count + 1 : _color_count - 1;
+			}
+			float mean[3];
+			bool moved = false;
+			for (size_t c = 0; c < 3; ++c) {
+				mean[c] = static_cast<float>(_color_sum[c] / static_cast<double>(_color_count));
+				moved = moved || std::abs(mean[c] - _mean[c]) > _mean_tolerance;
+			}
+			if (moved) {
+				_set_mean(mean);
+			}
+			return moved;
+		}
+
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP> void _detach_elem(ptr_t elem) {
+			const node_links &en = _ln[elem];
 			if (elem == _tl) {
 				_tl = en.*XP;
 			} else if (elem == _br) {
 				_br = en.*XN;
 			}
 			if (en.*XN != null) {
-				_pderef(en.*XN).*XP = en.*XP;
+				_ln[en.*XN].*XP = en.*XP;
 			}
 			if (en.*XP != null) {
-				_pderef(en.*XP).*XN = en.*XN;
+				_ln[en.*XP].*XN = en.*XN;
 			}
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> void _fix_detached_links(ptr_t prev) {
-			node &pn = _pderef(prev), &nn = _pderef(pn.path_ptr);
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _fix_detached_links(ptr_t prev) {
+			const node_links &pn = _ln[prev], &nn = _ln[_dp_of<XN>().nodes[prev].path_ptr];
 			ptr_t u, d;
 			if (nn.*XP == pn.*YP) {
 				u = pn.*XN;
@@ -265,72 +731,188 @@ namespace seam_carving {
 				u = pn.*XP;
 				d = nn.*XN;
 			}
-			_pderef(u).*YP = d;
-			_pderef(d).*YN = u;
+			_ln[u].*YP = d;
+			_ln[d].*YN = u;
 		}
 
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> void _recalc_dp() {
-			for (ptr_t x = _br; x != null; x = _pderef(x).*XN) {
-				_pderef(x).dp = _pderef(x).energy;
-				_pderef(x).path_ptr = null;
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _recalc_dp() {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			size_t w = XN == &node_links::left ? _w : _h, h = XN == &node_links::left ? _h : _w;
+			if (_parallel.enabled_for(w)) {
+				_recalc_dp_parallel<XN, XP, YN, YP>(w, h);
+				return;
+			}
+			for (ptr_t x = _br; x != null; x = _ln[x].*XN) {
+				dn[x].dp = _first_dp<XN, XP, YP>(x);
+				dn[x].path_ptr = null;
 			}
-			for (ptr_t y = _pderef(_br).*YN; y != null; y = _pderef(y).*YN) {
+			if (_dp_of<XN>().step_costs) {
+				for (ptr_t y = _ln[_br].*YN; y != null; y = _ln[y].*YN) {
+					for (ptr_t x = y; x != null; x = _ln[x].*XN) {
+						_recalc_dp_elem<XN, XP, YP>(x);
+					}
+				}
+				_inc_upd_nodes_full();
+				_dp_of<XN>().fresh = true;
+				return;
+			}
+			for (ptr_t y = _ln[_br].*YN; y != null; y = _ln[y].*YN) {
 				ptr_t x = y;
-				node *xn = &_pderef(x), *xdn = &_pderef(xn->*YP);
-				xn->path_ptr = xn->*YP;
+				const node_links *xn = &_ln[x], *xdn = &_ln[xn->*YP];
+				_dp_node *xd = &dn[x];
+				real_t mdpv = dn[xn->*YP].dp;
+				xd->path_ptr = xn->*YP;
 				if (xn->*XN != null) {
-					if (_pderef(xdn->*XN).dp < xdn->dp) {
-						xn->path_ptr = xdn->*XN;
-						xn->dp = _pderef(xn->path_ptr).dp;
-					} else {
-						xn->dp = xdn->dp;
+					if (dn[xdn->*XN].dp < mdpv) {
+						xd->path_ptr = xdn->*XN;
+						mdpv = dn[xdn->*XN].dp;
 					}
-					xn->dp += xn->energy + xn->compensation;
-					for (x = xn->*XN, xn = &_pderef(x); xn->*XN != null; x = xn->*XN, xn = &_pderef(x)) {
-						xdn = &_pderef(xn->*YP);
-						real_t mdpv = xdn->dp;
-						xn->path_ptr = xn->*YP;
-						if (_pderef(xdn->*XN).dp < mdpv) {
-							xn->path_ptr = xdn->*XN;
-							mdpv = _pderef(xdn->*XN).dp;
+					xd->dp = mdpv + xd->cost;
+					for (x = xn->*XN, xn = &_ln[x]; xn->*XN != null; x = xn->*XN, xn = &_ln[x]) {
+						xdn = &_ln[xn->*YP];
+						xd = &dn[x];
+						mdpv = dn[xn->*YP].dp;
+						xd->path_ptr = xn->*YP;
+						if (dn[xdn->*XN].dp < mdpv) {
+							xd->path_ptr = xdn->*XN;
+							mdpv = dn[xdn->*XN].dp;
 						}
-						if (_pderef(xdn->*XP).dp < mdpv) {
-							xn->path_ptr = xdn->*XP;
-							mdpv = _pderef(xdn->*XP).dp;
+						if (dn[xdn->*XP].dp < mdpv) {
+							xd->path_ptr = xdn->*XP;
+							mdpv = dn[xdn->*XP].dp;
 						}
-						xn->dp = mdpv + xn->energy + xn->compensation;
+						xd->dp = mdpv + xd->cost;
 					}
-					xdn = &_pderef(xn->*YP);
-					xn->path_ptr = xn->*YP;
-					if (_pderef(xdn->*XP).dp < xdn->dp) {
-						xn->path_ptr = xdn->*XP;
-						xn->dp = _pderef(xn->path_ptr).dp;
-					} else {
-						xn->dp = xdn->dp;
+					xdn = &_ln[xn->*YP];
+					xd = &dn[x];
+					mdpv = dn[xn->*YP].dp;
+					xd->path_ptr = xn->*YP;
+					if (dn[xdn->*XP].dp < mdpv) {
+						xd->path_ptr = xdn->*XP;
+						mdpv = dn[xdn->*XP].dp;
 					}
-					xn->dp += xn->energy + xn->compensation;
-				} else {
-					xn->dp = xdn->dp + xn->energy + xn->compensation;
 				}
+				xd->dp = mdpv + xd->cost;
 			}
 			_inc_upd_nodes_full();
-			_fresh_dp = true;
+			_dp_of<XN>().fresh = true;
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> bool _update_dp_elem(ptr_t pos) {
-			node &cur = _pderef(pos);
-			ptr_t best = cur.*YP;
-			node &down = _pderef(best);
-			if (down.*XN != null) {
-				if (_pderef(down.*XN).dp < down.dp) {
-					best = down.*XN;
+		// same as _recalc_dp, with every row split into chunks of consecutive nodes. The first node of each chunk
+		// is found once on the bottom row and then followed upwards through YN
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _recalc_dp_parallel(size_t w, size_t h) {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			size_t n = _parallel.get_threads();
+			_chunk_starts.resize(n);
+			ptr_t x = _br;
+			for (size_t t = 0, i = 0; t < n; ++t) {
+				for (size_t end = parallel_dp::chunk_begin(t, n, w); i < end; ++i) {
+					x = _ln[x].*XN;
 				}
+				_chunk_starts[t] = x;
 			}
-			if (down.*XP != null) {
-				if (_pderef(down.*XP).dp < _pderef(best).dp) {
-					best = down.*XP;
+			_parallel.run([&](size_t t, size_t, spin_barrier &barrier) {
+				size_t count = parallel_dp::chunk_begin(t + 1, n, w) - parallel_dp::chunk_begin(t, n, w);
+				ptr_t start = _chunk_starts[t], cur = start;
+				for (size_t i = 0; i < count; ++i, cur = _ln[cur].*XN) {
+					dn[cur].dp = _first_dp<XN, XP, YP>(cur);
+					dn[cur].path_ptr = null;
 				}
+				for (size_t y = 1; y < h; ++y) {
+					barrier.wait();
+					if (count > 0) {
+						start = _ln[start].*YN;
+						cur = start;
+						for (size_t i = 0; i < count; ++i, cur = _ln[cur].*XN) {
+							_recalc_dp_elem<XN, XP, YP>(cur);
+						}
+					}
+				}
+			});
+			_inc_upd_nodes_full();
+			_dp_of<XN>().fresh = true;
+		}
+		// one node of _recalc_dp, including the ends of the row that it handles outside its inner loop
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP> void _recalc_dp_elem(ptr_t pos) {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			const node_links &xn = _ln[pos], &xdn = _ln[xn.*YP];
+			_dp_node &xd = dn[pos];
+			if (_dp_of<XN>().step_costs) {
+				xd.dp = _best_step<XN, XP, YP>(pos, xd.path_ptr);
+				return;
+			}
+			real_t mdpv = dn[xn.*YP].dp;
+			xd.path_ptr = xn.*YP;
+			if (xn.*XN == null || xn.*XP == null) {
+				if (xn.*XN != null || xn.*XP != null) {
+					ptr_t side = xn.*XP == null ? xdn.*XN : xdn.*XP;
+					if (dn[side].dp < mdpv) {
+						xd.path_ptr = side;
+						mdpv = dn[side].dp;
+					}
+				}
+				xd.dp = mdpv + xd.cost;
+				return;
+			}
+			if (dn[xdn.*XN].dp < mdpv) {
+				xd.path_ptr = xdn.*XN;
+				mdpv = dn[xdn.*XN].dp;
+			}
+			if (dn[xdn.*XP].dp < mdpv) {
+				xd.path_ptr = xdn.*XP;
+				mdpv = dn[xdn.*XP].dp;
+			}
+			xd.dp = mdpv + xd.cost;
+		}
+		// the DP value of a node on the first line, which pays a straight step for energies with transition costs
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP> real_t _first_dp(ptr_t pos) {
+			_dp_state &s = _dp_of<XN>();
+			if (!s.step_costs) {
+				return s.nodes[pos].cost;
+			}
+			real_t steps[3];
+			s.step_costs(*this, pos, steps);
+			return s.nodes[pos].cost + steps[1];
+		}
+		// the DP value of a node that is not on the first line for energies with transition costs, and its best
+		// predecessor in best, with the same ties as the other loops
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP> real_t _best_step(ptr_t pos, ptr_t &best) {
+			_dp_state &s = _dp_of<XN>();
+			real_t steps[3];
+			s.step_costs(*this, pos, steps);
+			best = _ln[pos].*YP;
+			const node_links &down = _ln[best];
+			real_t v = s.nodes[best].dp + steps[1];
+			if (down.*XN != null && s.nodes[down.*XN].dp + steps[0] < v) {
+				best = down.*XN;
+				v = s.nodes[best].dp + steps[0];
+			}
+			if (down.*XP != null && s.nodes[down.*XP].dp + steps[2] < v) {
+				best = down.*XP;
+				v = s.nodes[best].dp + steps[2];
+			}
+			return v + s.nodes[pos].cost;
+		}
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> bool _update_dp_elem(ptr_t pos) {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			_dp_node &cur = dn[pos];
+			ptr_t best = _ln[pos].*YP;
+			real_t ndp;
+			if (_dp_of<XN>().step_costs) {
+				ndp = _best_step<XN, XP, YP>(pos, best);
+			} else {
+				const node_links &down = _ln[best];
+				if (down.*XN != null) {
+					if (dn[down.*XN].dp < dn[best].dp) {
+						best = down.*XN;
+					}
+				}
+				if (down.*XP != null) {
+					if (dn[down.*XP].dp < dn[best].dp) {
+						best = down.*XP;
+					}
+				}
+				ndp = dn[best].dp + cur.cost;
 			}
-			real_t ndp = _pderef(best).dp + cur.energy + cur.compensation;
 			if (cur.path_ptr != best || ndp != cur.dp) {
 				cur.dp = ndp;
 				cur.path_ptr = best;
@@ -338,27 +920,34 @@ namespace seam_carving {
 			}
 			return false;
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> struct _region {
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> struct _region {
 			ptr_t min, max;
 			int minoffset, maxoffset;
 
-			inline static int get_offset_1(dancing_link_retargeter &ret, node &below, ptr_t above) {
+			inline static int get_offset_1(dancing_link_retargeter &ret, ptr_t belowp, ptr_t above) {
+				const node_links &below = ret._ln[belowp];
 				if (above == below.*YN) {
 					return 0;
 				}
-				node &aboven = ret._pderef(above);
+				const node_links &aboven = ret._ln[above];
 				if (aboven.*XN == below.*YN) {
 					return 1;
 				}
 				assert(aboven.*XP == below.*YN);
 				return -1;
 			}
+			// the nodes next to the removed node p, and for diagonal energies the ones after them, whose energies
+			// have changed as well
 			void reset(dancing_link_retargeter &ret, ptr_t p, int offset) {
-				node &n = ret._pderef(p);
+				const node_links &n = ret._ln[p];
 				assert(n.*XN != null || n.*XP != null);
 				if (n.*XN != null) {
 					min = n.*XN;
 					minoffset = offset - 1;
+					if (ret._diagonal_energy && ret._ln[min].*XN != null) {
+						min = ret._ln[min].*XN;
+						--minoffset;
+					}
 				} else {
 					min = n.*XP;
 					minoffset = offset;
@@ -366,13 +955,17 @@ namespace seam_carving {
 				if (n.*XP != null) {
 					max = n.*XP;
 					maxoffset = offset;
+					if (ret._diagonal_energy && ret._ln[max].*XP != null) {
+						max = ret._ln[max].*XP;
+						++maxoffset;
+					}
 				} else {
 					max = n.*XN;
 					maxoffset = offset - 1;
 				}
 			}
 			void add_first(dancing_link_retargeter &ret, ptr_t p, int offset) {
-				node &n = ret._pderef(p);
+				const node_links &n = ret._ln[p];
 				ptr_t minv = p, maxv = p;
 				int mino = offset, maxo = offset;
 				if (n.*XN != null) {
@@ -395,7 +988,7 @@ namespace seam_carving {
 				}
 			}
 			void add(dancing_link_retargeter &ret, ptr_t p, int offset) {
-				node &n = ret._pderef(p);
+				const node_links &n = ret._ln[p];
 				ptr_t maxv = p;
 				int maxo = offset;
 				if (n.*XP != null) {
@@ -409,44 +1002,47 @@ namespace seam_carving {
 				}
 			}
 		};
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> void _calc_dp_incremental(ptr_t lastpath) {
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _calc_dp_incremental(ptr_t lastpath) {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
 			std::vector<ptr_t> path;
-			for (ptr_t p = lastpath; p != null; p = _pderef(p).path_ptr) {
+			for (ptr_t p = lastpath; p != null; p = dn[p].path_ptr) {
 				path.push_back(p);
 			}
 			_region<XN, XP, YN, YP> curr, nextr;
 
-			node *cur = &_pderef(path.back());
+			ptr_t cur = path.back();
 			path.pop_back();
-			int offset = curr.get_offset_1(*this, *cur, path.back());
+			int offset = curr.get_offset_1(*this, cur, path.back());
 			nextr.reset(*this, path.back(), offset);
-			if (cur->*XN != null) {
-				node &xn = _pderef(cur->*XN);
-				xn.dp = xn.energy + xn.compensation;
-				nextr.add_first(*this, xn.*YN, -1);
+			// on the first line only the costs of these nodes have changed
+			int side = 0;
+			for (ptr_t p = _ln[cur].*XN; p != null && side > (_diagonal_energy ? -2 : -1); p = _ln[p].*XN) {
+				dn[p].dp = _first_dp<XN, XP, YP>(p);
+				nextr.add_first(*this, _ln[p].*YN, --side);
+				++_updated_nodes;
 			}
-			if (cur->*XP != null) {
-				node &xp = _pderef(cur->*XP);
-				xp.dp = xp.energy + xp.compensation;
-				nextr.add_first(*this, xp.*YN, 0);
+			side = -1;
+			for (ptr_t p = _ln[cur].*XP; p != null && side < (_diagonal_energy ? 1 : 0); p = _ln[p].*XP) {
+				dn[p].dp = _first_dp<XN, XP, YP>(p);
+				nextr.add_first(*this, _ln[p].*YN, ++side);
+				++_updated_nodes;
 			}
-			cur = &_pderef(path.back());
-			_updated_nodes += 2;
+			cur = path.back();
 
 			do {
 				std::swap(curr, nextr);
 				path.pop_back();
-				offset += curr.get_offset_1(*this, *cur, path.back());
+				offset += curr.get_offset_1(*this, cur, path.back());
 				nextr.reset(*this, path.back(), offset);
 				int of = curr.minoffset;
 				bool first = true;
-				for (ptr_t p = curr.min; ; p = _pderef(p).*XP, ++of) {
-					if (_update_dp_elem<XN, XP, YN, YP>(p) || p == cur->*XN || p == cur->*XP) {
+				for (ptr_t p = curr.min; ; p = _ln[p].*XP, ++of) {
+					if (_update_dp_elem<XN, XP, YN, YP>(p) || p == _ln[cur].*XN || p == _ln[cur].*XP) {
 						if (first) {
-							nextr.add_first(*this, _pderef(p).*YN, of);
+							nextr.add_first(*this, _ln[p].*YN, of);
 							first = false;
 						} else {
-							nextr.add(*this, _pderef(p).*YN, of);
+							nextr.add(*this, _ln[p].*YN, of);
 						}
 					}
 					if (p == curr.max) {
@@ -454,63 +1050,293 @@ namespace seam_carving {
 					}
 				}
 				_updated_nodes += static_cast<size_t>(curr.maxoffset - curr.minoffset + 1);
-				cur = &_pderef(path.back());
+				cur = path.back();
 			} while (path.size() > 1);
 
-			for (ptr_t p = nextr.min; ; p = _pderef(p).*XP) {
+			for (ptr_t p = nextr.min; ; p = _ln[p].*XP) {
 				_update_dp_elem<XN, XP, YN, YP>(p);
 				if (p == nextr.max) {
 					break;
 				}
 			}
 			_updated_nodes += static_cast<size_t>(nextr.maxoffset - nextr.minoffset + 1);
-			_fresh_dp = true;
+			_dp_of<XN>().fresh = true;
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> void _update_dp(orientation orient) {
-#ifdef USE_INCREMENTAL
-			if (_fresh_dp && _cps.size() > 0 && _cps.back().second == orient) {
-				_calc_dp_incremental<XN, XP, YN, YP>(_cps.back().first);
+		// the orientation of the seams that the DP finds when lines run along XN and XP, which the enlarging tables
+		// label by their direction instead
+		template <ptr_t node_links::*XN> inline static orientation _seam_orientation() {
+			return XN == &node_links::left ? orientation::vertical : orientation::horizontal;
+		}
+		// the DP values of these seams, which also hold the paths of the seams of this orientation that are carved
+		template <ptr_t node_links::*XN> _dp_state &_dp_of() {
+			return _dps[static_cast<size_t>(_seam_orientation<XN>())];
+		}
+		void _invalidate_dp() {
+			for (_dp_state &s : _dps) {
+				s.fresh = false;
+				s.dirty = false;
+			}
+		}
+		// moves pos, the position of the seam node c along its line counted from the XN end, to that of the next
+		// node n of the seam. Seam nodes keep linking to their old neighbors while they are carved
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YP> void _next_seam_pos(ptr_t c, ptr_t n, size_t &pos) const {
+			if (_ln[n].*XP == _ln[c].*YP) {
+				--pos;
+			} else if (_ln[n].*XN == _ln[c].*YP) {
+				++pos;
 			} else {
+				assert(n == _ln[c].*YP);
+			}
+		}
+		// after a seam of the other orientation has been carved or restored, every line loses or gains the node
+		// where the seam crosses it. The values on the YN side of the seam change, along with those next to it
+		// whose costs have changed, and are recomputed from there towards YN one position along the lines at a
+		// time, so that the values that they read have always been updated before
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _calc_dp_cross(ptr_t head, bool restored) {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			const std::vector<_dp_node> &seam = _dp_of<YN>().nodes;
+			// the position of the seam on the current line, counted from the YN end. The seam runs towards XP
+			size_t pos = 0;
+			for (ptr_t p = _ln[head].*YN; p != null; p = _ln[p].*YN) {
+				++pos;
+			}
+			_cross_starts.clear();
+			for (ptr_t c = head; c != null; ) {
+				const node_links &cn = _ln[c];
+				ptr_t start = cn.*YP;
+				size_t at = restored ? pos + 1 : pos;
+				if (start == null) {
+					start = restored ? c : cn.*YN;
+					--at;
+				} else if (_diagonal_energy && _ln[start].*YP != null) {
+					start = _ln[start].*YP;
+					++at;
+				}
+				if (start != null) {
+					_cross_starts.push_back({at, start});
+				}
+				ptr_t n = seam[c].path_ptr;
+				if (n != null) {
+					_next_seam_pos<YN, YP, XP>(c, n, pos);
+				}
+				c = n;
+			}
+			if (_cross_starts.empty()) {
+				return;
+			}
+			std::sort(_cross_starts.begin(), _cross_starts.end(), [](const std::pair<size_t, ptr_t> &a, const std::pair<size_t, ptr_t> &b) {
+				return a.first > b.first;
+			});
+			_cross_cursors.clear();
+			size_t next = 0;
+			for (size_t at = _cross_starts[0].first + 1; at-- > 0; ) {
+				for (; next < _cross_starts.size() && _cross_starts[next].first == at; ++next) {
+					_cross_cursors.push_back(_cross_starts[next].second);
+				}
+				for (ptr_t &p : _cross_cursors) {
+					if (_ln[p].*YP == null) {
+						dn[p].dp = _first_dp<XN, XP, YP>(p);
+						dn[p].path_ptr = null;
+					} else {
+						_recalc_dp_elem<XN, XP, YP>(p);
+					}
+					p = _ln[p].*YN;
+				}
+				_updated_nodes += _cross_cursors.size();
+			}
+		}
+		// recomputes DP values line by line from line last towards YN: on the lines from last to first the nodes
+		// that range(l, start, lo, hi) sets, starting with start at position lo along the line, and on every line
+		// those next to values that have changed on the line before, until nothing changes any more
+		template <
+			ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP, typename Range
+		> void _propagate_dp(size_t first, size_t last, Range &&range) {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			size_t len = XN == &node_links::left ? _w : _h, lines = XN == &node_links::left ? _h : _w;
+			ptr_t start = null;
+			size_t lo = len, hi = 0;
+			for (size_t l = last; ; --l) {
+				if (l >= first) {
+					ptr_t rstart;
+					size_t rlo, rhi;
+					range(l, rstart, rlo, rhi);
+					if (rlo < lo) {
+						start = rstart;
+						lo = rlo;
+					}
+					hi = std::max(hi, rhi);
+				}
+				size_t clo = len, chi = 0;
+				ptr_t cfirst = null, p = start;
+				for (size_t i = lo; i < hi; ++i, p = _ln[p].*XP) {
+					bool changed;
+					if (l + 1 == lines) {
+						real_t dp = _first_dp<XN, XP, YP>(p);
+						changed = dn[p].dp != dp;
+						dn[p].dp = dp;
+						dn[p].path_ptr = null;
+					} else {
+						changed = _update_dp_elem<XN, XP, YN, YP>(p);
+					}
+					if (changed) {
+						if (cfirst == null) {
+							clo = i;
+							cfirst = p;
+						}
+						chi = i + 1;
+					}
+				}
+				_updated_nodes += hi - lo;
+				if (l == 0 || (cfirst == null && l <= first)) {
+					break;
+				}
+				lo = len;
+				hi = 0;
+				if (cfirst != null) {
+					start = _ln[cfirst].*YN;
+					if (clo > 0) {
+						start = _ln[start].*XN;
+					}
+					lo = clo > 0 ? clo - 1 : 0;
+					hi = std::min(chi + 1, len);
+				}
+			}
+		}
+		// recomputes the DP values of the dirty rectangle and those that depend on them
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _calc_dp_dirty() {
+			_dp_state &s = _dp_of<XN>();
+			// c indexes the coordinate along the lines
+			size_t c = XN == &node_links::left ? 0 : 1;
+			size_t rlo = s.dirty_min[c], rhi = s.dirty_max[c], rlast = s.dirty_max[1 - c] - 1;
+			// the node at rlo on the current line
+			ptr_t rstart = c == 0 ? _at_impl(rlo, rlast) : _at_impl(rlast, rlo);
+			_propagate_dp<XN, XP, YN, YP>(s.dirty_min[1 - c], rlast, [&](size_t l, ptr_t &start, size_t &lo, size_t &hi) {
+				if (l != rlast) {
+					rstart = _ln[rstart].*YN;
+				}
+				start = rstart;
+				lo = rlo;
+				hi = rhi;
+			});
+			s.dirty = false;
+		}
+		// after a seam of this orientation has been restored, its nodes and the two on either side of them are
+		// recomputed on every line along with the values that depend on them. Their costs or links have changed,
+		// or the node after them towards YP links to the restored node, which may still hold the same values
+		// that it had before it was carved. Returns the number of lines
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> size_t _calc_dp_restored(ptr_t head) {
+			const std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			size_t len = XN == &node_links::left ? _w : _h;
+			// the seam and the positions of its nodes along the lines; the path through them is overwritten below
+			std::vector<std::pair<size_t, ptr_t>> seam;
+			size_t pos = 0;
+			for (ptr_t p = _ln[head].*XN; p != null; p = _ln[p].*XN) {
+				++pos;
+			}
+			for (ptr_t c = head; c != null; c = dn[c].path_ptr) {
+				seam.push_back({pos, c});
+				if (dn[c].path_ptr != null) {
+					_next_seam_pos<XN, XP, YP>(c, dn[c].path_ptr, pos);
+				}
+			}
+			_propagate_dp<XN, XP, YN, YP>(0, seam.size() - 1, [&](size_t l, ptr_t &start, size_t &lo, size_t &hi) {
+				start = seam[l].second;
+				lo = seam[l].first;
+				for (size_t i = 0; i < 2 && lo > 0; ++i, --lo) {
+					start = _ln[start].*XN;
+				}
+				hi = std::min(seam[l].first + 3, len);
+			});
+			return seam.size();
+		}
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _update_dp() {
+			_dp_state &s = _dp_of<XN>();
+			if (s.nodes.empty()) {
+				s.nodes = _dp_of<YN>().nodes;
+			}
+#ifdef USE_INCREMENTAL
+			if (!s.fresh) {
 				_recalc_dp<XN, XP, YN, YP>();
+				s.dirty = false;
+			} else if (s.pending != null) {
+				_calc_dp_incremental<XN, XP, YN, YP>(s.pending);
+			}
+			if (s.dirty) {
+				_calc_dp_dirty<XN, XP, YN, YP>();
 			}
+			s.used = true;
 #else
 			_recalc_dp<XN, XP, YN, YP>();
+			s.dirty = false;
 #endif
+			s.pending = null;
+			s.restore_work = 0;
 		}
 
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> ptr_t _get_carve_path_impl() {
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> ptr_t _get_carve_path_impl() {
+			std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
 			ptr_t res = _tl;
-			for (ptr_t cur = _pderef(_tl).*XP; cur != null; cur = _pderef(cur).*XP) {
-				if (_pderef(cur).dp < _pderef(res).dp) {
+			for (ptr_t cur = _ln[_tl].*XP; cur != null; cur = _ln[cur].*XP) {
+				if (dn[cur].dp < dn[res].dp) {
 					res = cur;
 				}
 			}
 			return res;
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP> void _carve_path_impl(ptr_t head) {
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _carve_path_impl(ptr_t head) {
+			_dp_state &own = _dp_of<XN>(), &cross = _dp_of<YN>();
+			// the DP can only follow a single seam that it has found itself, and dirty rectangles are lost when
+			// nodes move
+			if (own.pending != null || own.dirty) {
+				own.fresh = false;
+				own.dirty = false;
+			}
+			own.pending = null;
+			if (own.fresh) {
+				own.pending = head;
+			}
+			// the values of the other orientation are brought up to date before the grid changes, if they are
+			// still in use
+			bool keep_cross = cross.fresh && cross.used;
+			if (keep_cross) {
+				_update_dp<YN, YP, XN, XP>();
+			} else {
+				cross.fresh = false;
+				cross.dirty = false;
+			}
+			const std::vector<_dp_node> &dn = own.nodes;
 			_detach_elem<XN, XP>(head);
-			for (ptr_t prv = head, n = _pderef(prv).path_ptr; n != null; prv = n, n = _pderef(n).path_ptr) {
+			for (ptr_t prv = head, n = dn[prv].path_ptr; n != null; prv = n, n = dn[n].path_ptr) {
 				_detach_elem<XN, XP>(n);
-				if (n != _pderef(prv).*YP) {
+				if (n != _ln[prv].*YP) {
 					_fix_detached_links<XN, XP, YN, YP>(prv);
 				}
 			}
-			_recalc_path_side_energy<XN, XP>(head);
+			size_t &size = XN == &node_links::left ? _w : _h;
+			--size;
+			_update_heads<XN, XP>(head, false);
+			_recalc_path_side_energy<XN, XP>(head, -1.0);
+			if (keep_cross && cross.fresh) {
+				_calc_dp_cross<YN, YP, XN, XP>(head, false);
+				cross.used = false;
+			}
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP> void _restore_path_impl(ptr_t p) {
-			for (ptr_t cur = p; cur != null; cur = _pderef(cur).path_ptr) {
-				node &cn = _pderef(cur);
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP> void _restore_path_impl(ptr_t p) {
+			_dp_state &own = _dp_of<XN>(), &cross = _dp_of<YN>();
+			const std::vector<_dp_node> &dn = own.nodes;
+			for (ptr_t cur = p; cur != null; cur = dn[cur].path_ptr) {
+				const node_links &cn = _ln[cur];
 				if (cn.left != null) {
-					_pderef(cn.left).right = cur;
+					_ln[cn.left].right = cur;
 				}
 				if (cn.up != null) {
-					_pderef(cn.up).down = cur;
+					_ln[cn.up].down = cur;
 				}
 				if (cn.right != null) {
-					_pderef(cn.right).left = cur;
+					_ln[cn.right].left = cur;
 				}
 				if (cn.down != null) {
-					_pderef(cn.down).up = cur;
+					_ln[cn.down].up = cur;
 				}
 				if (cn.left == null && cn.up == null) {
 					_tl = cur;
@@ -519,121 +1345,261 @@ namespace seam_carving {
 					_br = cur;
 				}
 			}
-			_recalc_path_side_energy<XN, XP>(p);
-			_fresh_dp = false;
+			size_t &size = XN == &node_links::left ? _w : _h;
+			++size;
+			_update_heads<XN, XP>(p, true);
+			_recalc_path_side_energy<XN, XP>(p, 1.0);
+			// dirty rectangles are lost when nodes move. Restoring the seam that has just been carved brings back
+			// the grid that the values were computed for
+			if (own.dirty || (own.pending != null && own.pending != p)) {
+				own.fresh = false;
+				own.dirty = false;
+			}
+			if (cross.dirty || cross.pending != null) {
+				cross.fresh = false;
+				cross.dirty = false;
+			}
+			// the path through the seam is needed until the values of this orientation are updated
+			if (cross.fresh && cross.used) {
+				_calc_dp_cross<YN, YP, XN, XP>(p, true);
+				cross.used = false;
+			} else {
+				cross.fresh = false;
+			}
+			// the values are only updated while this and the remaining restores of retarget() are expected to cost
+			// less than the full sweep that the next lookup makes otherwise. Each update is expected to cost as much
+			// as the last one, and the first one is made to find out
+			size_t ahead = std::max<size_t>(own.restores_ahead, 1);
+			own.restores_ahead = ahead - 1;
+			if (own.fresh && own.pending == null) {
+				if (own.restore_work + ahead * own.restore_cost < _w * _h) {
+					size_t updated = _updated_nodes;
+					size_t lines = _calc_dp_restored<XN, XP, YN, YP>(p);
+					own.restore_cost = _updated_nodes - updated + lines * _restored_line_cost;
+					own.restore_work += own.restore_cost;
+				} else {
+					own.fresh = false;
+				}
+			}
+			own.pending = null;
 		}
-		template <ptr_t node::*XN, ptr_t node::*XP> void _recalc_path_side_energy(ptr_t head) {
-			for (ptr_t cur = head; cur != null; cur = _pderef(cur).path_ptr) {
-				if (_pderef(cur).*XN != null) {
-					_calc_energy_elem(_pderef(cur).*XN);
+		// sets the number of seams of each orientation that retarget() restores to reach the given size
+		void _count_restores_ahead(size_t width, size_t height) {
+			size_t w = _w, h = _h;
+			for (auto it = _cps.rbegin(); it != _cps.rend(); ++it) {
+				size_t &size = it->second == orientation::horizontal ? h : w;
+				if (size >= (it->second == orientation::horizontal ? height : width)) {
+					break;
 				}
-				if (_pderef(cur).*XP != null) {
-					_calc_energy_elem(_pderef(cur).*XP);
+				++size;
+				++_dps[static_cast<size_t>(it->second)].restores_ahead;
+			}
+		}
+		// a seam has one node on every line that it crosses (rows for vertical seams), which may have been or
+		// become the first one, and it starts on the first of these lines, where it adds or removes a head of the
+		// lines that it runs along
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP> void _update_heads(ptr_t head, bool restored) {
+			std::vector<ptr_t> &crossed = XN == &node_links::left ? _row_heads : _col_heads;
+			std::vector<ptr_t> &along = XN == &node_links::left ? _col_heads : _row_heads;
+			const std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			size_t i = 0;
+			for (ptr_t cur = head; cur != null; cur = dn[cur].path_ptr, ++i) {
+				if (_ln[cur].*XN == null) {
+					crossed[i] = restored ? cur : _ln[cur].*XP;
+				}
+			}
+			if (restored) {
+				ptr_t next = _ln[head].*XP;
+				along.insert(next == null ? along.end() : std::find(along.begin(), along.end(), next), head);
+			} else {
+				along.erase(std::find(along.begin(), along.end(), head));
+			}
+			_row_major = false;
+		}
+		// the nodes next to the seam get new neighbors. Energies that read diagonal neighbors also change one node
+		// further out, and global ones change everywhere once the mean color moves, which also invalidates the DP.
+		// sign is -1 for a seam that has just been carved and 1 for one that has been restored
+		template <ptr_t node_links::*XN, ptr_t node_links::*XP> void _recalc_path_side_energy(ptr_t head, double sign) {
+			const std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+			if (_global_energy && _update_mean(dn, head, sign)) {
+				_calc_energies();
+				_invalidate_dp();
+				return;
+			}
+			// restored nodes get their old neighbors back, but global energies may have been computed with another mean
+			bool restored_stale = _global_energy && sign > 0.0;
+			for (ptr_t cur = head; cur != null; cur = dn[cur].path_ptr) {
+				ptr_t n = _ln[cur].*XN, p = _ln[cur].*XP;
+				if (restored_stale) {
+					_calc_energy_elem(cur);
+				}
+				if (n != null) {
+					_calc_energy_elem(n);
+					if (_diagonal_energy && _ln[n].*XN != null) {
+						_calc_energy_elem(_ln[n].*XN);
+					}
+				}
+				if (p != null) {
+					_calc_energy_elem(p);
+					if (_diagonal_energy && _ln[p].*XP != null) {
+						_calc_energy_elem(_ln[p].*XP);
+					}
 				}
 			}
 		}
 
 		template <typename ColorProc, typename Img> void _get_image_impl(Img &img) const {
 			size_t yi = 0;
-			for (ptr_t y = _tl; y != null; y = _pderef(y).down, ++yi) {
+			for (ptr_t y = _tl; y != null; y = _ln[y].down, ++yi) {
 				typename Img::element_type *dst = img.at_y(yi);
-				for (ptr_t x = y; x != null; x = _pderef(x).right, ++dst) {
-					*dst = typename Img::element_type(ColorProc::process(_pderef(x)));
+				for (ptr_t x = y; x != null; x = _ln[x].right, ++dst) {
+					*dst = typename Img::element_type(ColorProc::process(_colors[x], get_compensation(x)));
 				}
 			}
 			assert(yi == _h);
 		}
 
+		// carves the first count seams one after another, calls visit(i, path) for each and restores them all
 		template <
-			ptr_t node::*XN, ptr_t node::*XP, ptr_t node::*YN, ptr_t node::*YP
-		> enlarge_table_t _prepare_enlarging_impl(size_t wv, size_t hv, orientation orient) {
+			ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP, typename Visit
+		> void _prepare_enlarging_impl(size_t count, orientation orient, Visit &&visit) {
 			assert(_cps.size() == 0);
-			enlarge_table_t table;
-			table.reserve(wv);
-			for (size_t i = 0; i < wv; ++i) {
-				_update_dp<XN, XP, YN, YP>(orient);
-				std::vector<std::pair<size_t, size_t>> cpath;
-				cpath.reserve(hv);
+			for (size_t i = 0; i < count; ++i) {
+				_update_dp<XN, XP, YN, YP>();
 				ptr_t path = _get_carve_path_impl<XN, XP, YN, YP>();
 				_cps.push_back({path, orient});
-				for (ptr_t c = path; c != null; c = _pderef(c).path_ptr) {
-					size_t i = _pgetpos(c);
-					cpath.push_back({i % _w, i / _w});
-				}
+				visit(i, path);
 				_carve_path_impl<XN, XP, YN, YP>(path);
-				table.push_back(std::move(cpath));
 			}
+			// no seams are looked up while the grid is restored
+			_invalidate_dp();
 			while (!_cps.empty()) {
-				_restore_path_impl<XN, XP>(_cps.back().first);
+				_restore_path_impl<XN, XP, YN, YP>(_cps.back().first);
 				_cps.pop_back();
 			}
+		}
+		template <
+			ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP
+		> enlarge_table_t _prepare_enlarging_table(size_t wv, size_t hv, orientation orient) {
+			enlarge_table_t table;
+			table.reserve(wv);
+			size_t w = _w;
+			_prepare_enlarging_impl<XN, XP, YN, YP>(wv, orient, [this, w, hv, &table](size_t, ptr_t path) {
+				const std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+				std::vector<std::pair<size_t, size_t>> cpath;
+				cpath.reserve(hv);
+				for (ptr_t c = path; c != null; c = dn[c].path_ptr) {
+					size_t i = _origin_of(c);
+					cpath.push_back({i % w, i / w});
+				}
+				table.push_back(std::move(cpath));
+			});
+			return table;
+		}
+		template <
+			ptr_t node_links::*XN, ptr_t node_links::*XP, ptr_t node_links::*YN, ptr_t node_links::*YP
+		> compact_enlarge_table _prepare_enlarging_compact(size_t wv, orientation orient) {
+			compact_enlarge_table table;
+			table.orient = orient;
+			table.width = _w;
+			table.height = _h;
+			table.seams = std::min<size_t>(wv, std::numeric_limits<enlarge_rank_t>::max());
+			table.ranks.assign(_ln.size(), std::numeric_limits<enlarge_rank_t>::max());
+			_prepare_enlarging_impl<XN, XP, YN, YP>(table.seams, orient, [this, &table](size_t i, ptr_t path) {
+				const std::vector<_dp_node> &dn = _dp_of<XN>().nodes;
+				enlarge_rank_t rank = static_cast<enlarge_rank_t>(i);
+				for (ptr_t c = path; c != null; c = dn[c].path_ptr) {
+					table.ranks[_origin_of(c)] = rank;
+				}
+			});
 			return table;
 		}
 
-		size_t _at_y_impl(size_t y) const {
-			const_ptr_t res = _tl;
-			for (size_t i = 0; i < y; ++i) {
-				res = _pderef(res).down;
-			}
-			return _pgetpos(res);
+		ptr_t _at_y_impl(size_t y) const {
+			return _row_heads[y];
 		}
-		size_t _at_impl(size_t x, size_t y) const {
-			const_ptr_t res = at_y(y);
-			for (size_t i = 0; i < x; ++i) {
-				res = _pderef(res).right;
+		ptr_t _at_impl(size_t x, size_t y) const {
+			if (_row_major) {
+				return static_cast<ptr_t>(y * _w + x);
+			}
+			ptr_t res;
+			if (x <= y) {
+				res = _row_heads[y];
+				for (size_t i = 0; i < x; ++i) {
+					res = _ln[res].right;
+				}
+			} else {
+				res = _col_heads[x];
+				for (size_t i = 0; i < y; ++i) {
+					res = _ln[res].down;
+				}
 			}
-			return _pgetpos(res);
+			return res;
 		}
 
-#ifdef USE_INDEX_PTR
-		ptr_t _pref(node &n) const {
-			return &n - _n.data();
+		// the pixel index of a node in the image passed to set_image()
+		size_t _origin_of(ptr_t p) const {
+			return _origin.empty() ? p : _origin[p];
 		}
-		node &_pderef(ptr_t p) {
-			return _n[p];
-		}
-		const node &_pderef(const_ptr_t p) const {
-			return _n[p];
-		}
-		size_t _pgetpos(const_ptr_t p) const {
-			return p;
-		}
-		ptr_t _pfrompos(size_t v) const {
-			return v;
-		}
-#else
-		ptr_t _pref(node &n) {
-			return &n;
-		}
-		const_ptr_t _pref(const node &n) const {
-			return &n;
-		}
-		node &_pderef(ptr_t p) {
-			return *p;
-		}
-		const node &_pderef(const_ptr_t p) const {
-			return *p;
-		}
-		size_t _pgetpos(const_ptr_t p) const {
-			return p - _n.data();
-		}
-		ptr_t _pfrompos(size_t v) {
-			return &_n[v];
+		struct _identity {
+			template <typename T> inline const T &operator()(const T &v) const {
+				return v;
+			}
+		};
+		// v[i] = f(old v[order[i]])
+		template <typename T, typename F> inline static void _permute(std::vector<T> &v, const std::vector<ptr_t> &order, F &&f) {
+			if (v.empty()) {
+				return;
+			}
+			std::vector<T> res;
+			res.reserve(v.size());
+			for (ptr_t p : order) {
+				res.push_back(f(v[p]));
+			}
+			v.swap(res);
 		}
-		const_ptr_t _pfrompos(size_t v) const {
-			return &_n[v];
+		void _auto_compact() {
+			if (_compact_interval > 0 && ++_carves_since_compact >= _compact_interval) {
+				compact();
+			}
 		}
-#endif
 
 		void _inc_upd_nodes_full() {
 			_updated_nodes += _w * _h;
 		}
 
-		std::vector<node> _n;
+		std::vector<node_links> _ln;
+		// indexed by orientation
+		_dp_state _dps[2];
+		std::vector<color_t> _colors;
+		// empty until the first non-zero compensation is set
+		std::vector<real_t> _compensation;
+		// the pixel index of every node in the original image, empty until the first compaction
+		std::vector<ptr_t> _origin;
+		size_t _compact_interval = 0, _carves_since_compact = 0;
 		std::vector<std::pair<ptr_t, orientation>> _cps;
+		std::vector<ptr_t> _chunk_starts, _cross_cursors;
+		// where _calc_dp_cross starts on every line, with the position of these nodes along their lines
+		std::vector<std::pair<size_t, ptr_t>> _cross_starts;
+		// the lines of a grid are far apart in memory, so each line that the update for a restored seam visits costs
+		// about as much as this many nodes of a full sweep, on top of the nodes themselves
+		constexpr static size_t _restored_line_cost = 128;
+		parallel_dp _parallel;
 		ptr_t _tl = null, _br = null;
+		// the first node of every row and column
+		std::vector<ptr_t> _row_heads, _col_heads;
+		// whether the grid is stored row by row from index 0, as it is after set_image() and compact()
+		bool _row_major = false;
 		size_t _w = 0, _h = 0;
-		bool _fresh_dp = false;
 		size_t _updated_nodes = 0;
+		energy_type _energy_type = energy_type::squared_gradient;
+		_energy_selector::result_type _energy_func = select_energy<_energy_selector>(energy_type::squared_gradient);
+		_energy_row_selector::result_type _energy_row = select_energy<_energy_row_selector>(energy_type::squared_gradient);
+		bool _global_energy = false, _diagonal_energy = false;
+		// for global energies: the color sums and node count of the current grid, and the mean color the energies
+		// were computed with
+		double _color_sum[3] = {0.0, 0.0, 0.0};
+		size_t _color_count = 0;
+		float _mean[3] = {0.0f, 0.0f, 0.0f}, _unit_mean[3] = {0.0f, 0.0f, 0.0f}, _mean_tolerance = 1.0f;
 	};
 }
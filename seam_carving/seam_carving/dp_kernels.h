@@ -0,0 +1,346 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "simd.h"
+
+namespace seam_carving {
+	// predecessor offsets are stored as 2-bit codes (offset + 1), four pixels to a byte, pixel x in bits 2 * (x % 4)
+	struct dp_codes {
+		inline static size_t code_bytes(size_t w) {
+			return (w + 3) / 4;
+		}
+		inline static signed char get_dir(const unsigned char *codes, size_t x) {
+			return static_cast<signed char>(((codes[x >> 2] >> ((x & 3) * 2)) & 3) - 1);
+		}
+		inline static void set_dir(unsigned char *codes, size_t x, signed char dir) {
+			unsigned shift = static_cast<unsigned>(x & 3) * 2;
+			codes[x >> 2] = static_cast<unsigned char>(
+				(codes[x >> 2] & ~(3u << shift)) | (static_cast<unsigned>(dir + 1) << shift)
+			);
+		}
+		// removes the code of x from a row of w + 1 codes, moving the ones after it back by one position
+		inline static void erase_dir(unsigned char *codes, size_t x, size_t w) {
+			size_t i = x >> 2, end = code_bytes(w + 1);
+			unsigned keep = (1u << ((x & 3) * 2)) - 1, first = codes[i];
+			for (; i + 1 < end; ++i) {
+				codes[i] = static_cast<unsigned char>((codes[i] >> 2) | (codes[i + 1] << 6));
+			}
+			codes[i] = static_cast<unsigned char>(codes[i] >> 2);
+			codes[x >> 2] = static_cast<unsigned char>((first & keep) | (codes[x >> 2] & ~keep));
+		}
+		// moves the codes [begin, end) back by n positions, whole bytes at a time where possible
+		inline static void move_codes(unsigned char *codes, size_t begin, size_t end, size_t n) {
+			size_t x = begin - n, xend = end - n, q = n >> 2;
+			unsigned shift = static_cast<unsigned>(n & 3) * 2;
+			for (; x < xend && (x & 3) != 0; ++x) {
+				set_dir(codes, x, get_dir(codes, x + n));
+			}
+			for (; x + 4 <= xend; x += 4) {
+				size_t i = (x >> 2) + q;
+				codes[x >> 2] = static_cast<unsigned char>(
+					shift == 0 ? codes[i] : (codes[i] >> shift) | (codes[i + 1] << (8 - shift))
+				);
+			}
+			for (; x < xend; ++x) {
+				set_dir(codes, x, get_dir(codes, x + n));
+			}
+		}
+		// packs four codes held in the low bits of consecutive bytes into one byte
+		inline static unsigned char pack_codes(std::uint32_t v) {
+			return static_cast<unsigned char>((v * 0x01041040u) >> 24);
+		}
+	};
+
+	// vectorized loops of basic_dp_row_kernel, specialized below for each value type that has them
+	template <typename T> struct dp_row_simd {
+		using body_func = void(*)(const T*, const T*, T*, unsigned char*, size_t, size_t);
+
+		inline static body_func select(simd_level, body_func scalar) {
+			return scalar;
+		}
+	};
+
+	// One row of the seam DP: cur[x] = min(last[x - 1], last[x], last[x + 1]) + energy[x], and the code of x receives
+	// the offset (-1, 0 or 1) of the chosen predecessor. The sums are compared rather than the predecessors and
+	// ties go to the leftmost candidate, so every implementation produces bit-identical seams. T is float, or
+	// std::uint32_t for integer energies, where the DP is exact as long as the seam energies fit.
+	template <typename T> struct basic_dp_row_kernel : public dp_codes {
+		using value_type = T;
+		using body_func = void(*)(const T*, const T*, T*, unsigned char*, size_t, size_t);
+
+		inline static void row(const T *last, const T *energy, T *cur, unsigned char *codes, size_t w) {
+			range(last, energy, cur, codes, 0, w, w);
+		}
+		// the part [begin, end) of row(), for sweeps that split rows between threads
+		inline static void range(
+			const T *last, const T *energy, T *cur, unsigned char *codes, size_t begin, size_t end, size_t w
+		) {
+			assert(w > 1);
+			if (begin >= end) {
+				return;
+			}
+			size_t x = begin;
+			T e, best, v;
+			signed char dir;
+			if (x == 0) {
+				e = energy[0];
+				best = last[0] + e;
+				v = last[1] + e;
+				dir = 0;
+				if (v < best) {
+					best = v;
+					dir = 1;
+				}
+				*cur = best;
+				set_dir(codes, 0, dir);
+				x = 1;
+			}
+			size_t body_end = std::min(end, w - 1);
+			if (x < body_end) {
+				get_body()(last, energy, cur, codes, x, body_end);
+			}
+			if (end == w) {
+				x = w - 1;
+				e = energy[x];
+				best = last[x - 1] + e;
+				v = last[x] + e;
+				dir = -1;
+				if (v < best) {
+					best = v;
+					dir = 0;
+				}
+				cur[x] = best;
+				set_dir(codes, x, dir);
+			}
+		}
+		// a single element of row(), for updates that only touch a few cells of a row
+		inline static void cell(const T *last, T e, size_t x, size_t w, T &cur, signed char &dir) {
+			T best, v;
+			if (x > 0) {
+				best = last[x - 1] + e;
+				dir = -1;
+				v = last[x] + e;
+				if (v < best) {
+					best = v;
+					dir = 0;
+				}
+			} else {
+				best = last[x] + e;
+				dir = 0;
+			}
+			if (x + 1 < w) {
+				v = last[x + 1] + e;
+				if (v < best) {
+					best = v;
+					dir = 1;
+				}
+			}
+			cur = best;
+		}
+		// range() for energies that also charge the steps of the seam: steps[k][x] is added to last[x + k - 1]
+		// before the minimum is taken. Scalar, with the same ties as the other loops
+		inline static void range(
+			const T *last, const T *energy, const T *const *steps, T *cur, unsigned char *codes,
+			size_t begin, size_t end, size_t w
+		) {
+			for (size_t x = begin; x < end; ++x) {
+				const T step[3] = {steps[0][x], steps[1][x], steps[2][x]};
+				signed char dir;
+				cell(last, energy[x], step, x, w, cur[x], dir);
+				set_dir(codes, x, dir);
+			}
+		}
+		// cell() with the costs of the three steps into x
+		inline static void cell(const T *last, T e, const T *step, size_t x, size_t w, T &cur, signed char &dir) {
+			T best, v;
+			if (x > 0) {
+				best = last[x - 1] + step[0] + e;
+				dir = -1;
+				v = last[x] + step[1] + e;
+				if (v < best) {
+					best = v;
+					dir = 0;
+				}
+			} else {
+				best = last[x] + step[1] + e;
+				dir = 0;
+			}
+			if (x + 1 < w) {
+				v = last[x + 1] + step[2] + e;
+				if (v < best) {
+					best = v;
+					dir = 1;
+				}
+			}
+			cur = best;
+		}
+
+		inline static body_func get_body() {
+			static const body_func func = select_body(get_simd_level());
+			return func;
+		}
+		inline static body_func select_body(simd_level level) {
+			return dp_row_simd<T>::select(level, body_scalar);
+		}
+
+		inline static void body_scalar(
+			const T *last, const T *energy, T *cur, unsigned char *codes, size_t x, size_t end
+		) {
+			for (; x < end; ++x) {
+				T e = energy[x], best = last[x - 1] + e, v = last[x] + e;
+				signed char d = -1;
+				if (v < best) {
+					best = v;
+					d = 0;
+				}
+				v = last[x + 1] + e;
+				if (v < best) {
+					best = v;
+					d = 1;
+				}
+				cur[x] = best;
+				set_dir(codes, x, d);
+			}
+		}
+	};
+	using dp_row_kernel = basic_dp_row_kernel<float>;
+
+#ifdef SC_SIMD_X86
+	// the vector loops start at a multiple of 4 so that they write whole bytes of codes
+	template <> struct dp_row_simd<float> {
+		using body_func = void(*)(const float*, const float*, float*, unsigned char*, size_t, size_t);
+
+		inline static body_func select(simd_level level, body_func scalar) {
+			switch (level) {
+			case simd_level::avx2:
+				return body_avx2;
+			case simd_level::sse2:
+				return body_sse2;
+			default:
+				return scalar;
+			}
+		}
+
+		SC_TARGET_SSE2 inline static void body_sse2(
+			const float *last, const float *energy, float *cur, unsigned char *codes, size_t x, size_t end
+		) {
+			size_t aligned = std::min((x + 3) & ~static_cast<size_t>(3), end);
+			basic_dp_row_kernel<float>::body_scalar(last, energy, cur, codes, x, aligned);
+			const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+			for (x = aligned; x + 4 <= end; x += 4) {
+				__m128 e = _mm_loadu_ps(energy + x);
+				__m128 best = _mm_add_ps(_mm_loadu_ps(last + x - 1), e);
+				__m128 v = _mm_add_ps(_mm_loadu_ps(last + x), e);
+				__m128 m = _mm_cmplt_ps(v, best);
+				best = _mm_or_ps(_mm_and_ps(m, v), _mm_andnot_ps(m, best));
+				__m128i c = _mm_and_si128(_mm_castps_si128(m), one);
+				v = _mm_add_ps(_mm_loadu_ps(last + x + 1), e);
+				m = _mm_cmplt_ps(v, best);
+				best = _mm_or_ps(_mm_and_ps(m, v), _mm_andnot_ps(m, best));
+				__m128i mi = _mm_castps_si128(m);
+				c = _mm_or_si128(_mm_and_si128(mi, two), _mm_andnot_si128(mi, c));
+				_mm_storeu_ps(cur + x, best);
+				c = _mm_packs_epi32(c, c);
+				c = _mm_packus_epi16(c, c);
+				codes[x >> 2] = dp_codes::pack_codes(static_cast<std::uint32_t>(_mm_cvtsi128_si32(c)));
+			}
+			basic_dp_row_kernel<float>::body_scalar(last, energy, cur, codes, x, end);
+		}
+		SC_TARGET_AVX2 inline static void body_avx2(
+			const float *last, const float *energy, float *cur, unsigned char *codes, size_t x, size_t end
+		) {
+			size_t aligned = std::min((x + 3) & ~static_cast<size_t>(3), end);
+			basic_dp_row_kernel<float>::body_scalar(last, energy, cur, codes, x, aligned);
+			const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+			for (x = aligned; x + 8 <= end; x += 8) {
+				__m256 e = _mm256_loadu_ps(energy + x);
+				__m256 best = _mm256_add_ps(_mm256_loadu_ps(last + x - 1), e);
+				__m256 v = _mm256_add_ps(_mm256_loadu_ps(last + x), e);
+				__m256 m = _mm256_cmp_ps(v, best, _CMP_LT_OQ);
+				best = _mm256_blendv_ps(best, v, m);
+				__m256i c = _mm256_blendv_epi8(zero, one, _mm256_castps_si256(m));
+				v = _mm256_add_ps(_mm256_loadu_ps(last + x + 1), e);
+				m = _mm256_cmp_ps(v, best, _CMP_LT_OQ);
+				best = _mm256_blendv_ps(best, v, m);
+				c = _mm256_blendv_epi8(c, two, _mm256_castps_si256(m));
+				_mm256_storeu_ps(cur + x, best);
+				__m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+				packed = _mm_packus_epi16(packed, packed);
+				codes[x >> 2] = dp_codes::pack_codes(static_cast<std::uint32_t>(_mm_cvtsi128_si32(packed)));
+				codes[(x >> 2) + 1] = dp_codes::pack_codes(static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(packed, 4))));
+			}
+			body_sse2(last, energy, cur, codes, x, end);
+		}
+	};
+	// unsigned sums are compared as signed ones with the sign bit flipped, SSE2 & AVX2 have no unsigned compare
+	template <> struct dp_row_simd<std::uint32_t> {
+		using body_func = void(*)(const std::uint32_t*, const std::uint32_t*, std::uint32_t*, unsigned char*, size_t, size_t);
+
+		inline static body_func select(simd_level level, body_func scalar) {
+			switch (level) {
+			case simd_level::avx2:
+				return body_avx2;
+			case simd_level::sse2:
+				return body_sse2;
+			default:
+				return scalar;
+			}
+		}
+
+		SC_TARGET_SSE2 inline static void body_sse2(
+			const std::uint32_t *last, const std::uint32_t *energy, std::uint32_t *cur, unsigned char *codes, size_t x, size_t end
+		) {
+			size_t aligned = std::min((x + 3) & ~static_cast<size_t>(3), end);
+			basic_dp_row_kernel<std::uint32_t>::body_scalar(last, energy, cur, codes, x, aligned);
+			const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2), sign = _mm_set1_epi32(INT32_MIN);
+			for (x = aligned; x + 4 <= end; x += 4) {
+				__m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(energy + x));
+				__m128i best = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last + x - 1)), e);
+				__m128i v = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last + x)), e);
+				__m128i m = _mm_cmplt_epi32(_mm_xor_si128(v, sign), _mm_xor_si128(best, sign));
+				best = _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, best));
+				__m128i c = _mm_and_si128(m, one);
+				v = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last + x + 1)), e);
+				m = _mm_cmplt_epi32(_mm_xor_si128(v, sign), _mm_xor_si128(best, sign));
+				best = _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, best));
+				c = _mm_or_si128(_mm_and_si128(m, two), _mm_andnot_si128(m, c));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(cur + x), best);
+				c = _mm_packs_epi32(c, c);
+				c = _mm_packus_epi16(c, c);
+				codes[x >> 2] = dp_codes::pack_codes(static_cast<std::uint32_t>(_mm_cvtsi128_si32(c)));
+			}
+			basic_dp_row_kernel<std::uint32_t>::body_scalar(last, energy, cur, codes, x, end);
+		}
+		SC_TARGET_AVX2 inline static void body_avx2(
+			const std::uint32_t *last, const std::uint32_t *energy, std::uint32_t *cur, unsigned char *codes, size_t x, size_t end
+		) {
+			size_t aligned = std::min((x + 3) & ~static_cast<size_t>(3), end);
+			basic_dp_row_kernel<std::uint32_t>::body_scalar(last, energy, cur, codes, x, aligned);
+			const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+			const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+			for (x = aligned; x + 8 <= end; x += 8) {
+				__m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(energy + x));
+				__m256i best = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last + x - 1)), e);
+				__m256i v = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last + x)), e);
+				__m256i m = _mm256_cmpgt_epi32(_mm256_xor_si256(best, sign), _mm256_xor_si256(v, sign));
+				best = _mm256_blendv_epi8(best, v, m);
+				__m256i c = _mm256_blendv_epi8(zero, one, m);
+				v = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last + x + 1)), e);
+				m = _mm256_cmpgt_epi32(_mm256_xor_si256(best, sign), _mm256_xor_si256(v, sign));
+				best = _mm256_blendv_epi8(best, v, m);
+				c = _mm256_blendv_epi8(c, two, m);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(cur + x), best);
+				__m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+				packed = _mm_packus_epi16(packed, packed);
+				codes[x >> 2] = dp_codes::pack_codes(static_cast<std::uint32_t>(_mm_cvtsi128_si32(packed)));
+				codes[(x >> 2) + 1] = dp_codes::pack_codes(static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(packed, 4))));
+			}
+			body_sse2(last, energy, cur, codes, x, end);
+		}
+	};
+#endif
+}
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#include "utils.h"
+#include "simd.h"
+
+namespace seam_carving {
+	enum class energy_type {
+		gradient_l2,
+		squared_gradient,
+		l1,
+		sobel,
+		luminance,
+		mean_color,
+		forward
+	};
+
+	// energy policies shared by the carvers. evaluate() reads the 3 x 3 neighborhood of a pixel through s(c, dx, dy),
+	// channel c (0 to 2 for red, green and blue) of the pixel at offset (dx, dy), with offsets clamped to the image.
+	// Integer components give integer differences, so the same formula serves float and u8 pixels. Global
+	// policies also read the mean color of the current image through s.mean(c); removing any pixel changes all of
+	// their energies. diagonals tells whether corner pixels are read, which widens the incremental updates.
+	// transitions tells whether the policy also charges the steps of a seam through transition_costs()
+	namespace energy_policy {
+		template <typename Real, typename T> inline Real root(T v) {
+			return static_cast<Real>(std::sqrt(static_cast<float>(v)));
+		}
+		template <typename T> inline T absolute(T v) {
+			return std::abs(v);
+		}
+
+		// central differences; the order of the terms is kept so that results match the original carvers exactly
+		struct gradient_l2 {
+			constexpr static bool global = false, diagonals = false, transitions = false;
+
+			template <typename Real, typename S> inline static Real evaluate(const S &s) {
+				return root<Real>(
+					squared(s(0, 1, 0) - s(0, -1, 0)) + squared(s(1, 1, 0) - s(1, -1, 0)) + squared(s(2, 1, 0) - s(2, -1, 0)) +
+					squared(s(0, 0, -1) - s(0, 0, 1)) + squared(s(1, 0, -1) - s(1, 0, 1)) + squared(s(2, 0, -1) - s(2, 0, 1))
+				);
+			}
+		};
+		// gradient_l2 without the root; at most 6 * 255^2 for u8 pixels, so u32 seam energies hold 11000 rows
+		struct squared_gradient {
+			constexpr static bool global = false, diagonals = false, transitions = false;
+
+			template <typename Real, typename S> inline static Real evaluate(const S &s) {
+				return static_cast<Real>(
+					squared(s(0, 1, 0) - s(0, -1, 0)) + squared(s(1, 1, 0) - s(1, -1, 0)) + squared(s(2, 1, 0) - s(2, -1, 0)) +
+					squared(s(0, 0, -1) - s(0, 0, 1)) + squared(s(1, 0, -1) - s(1, 0, 1)) + squared(s(2, 0, -1) - s(2, 0, 1))
+				);
+			}
+		};
+		struct l1 {
+			constexpr static bool global = false, diagonals = false, transitions = false;
+
+			template <typename Real, typename S> inline static Real evaluate(const S &s) {
+				return static_cast<Real>(
+					absolute(s(0, 1, 0) - s(0, -1, 0)) + absolute(s(1, 1, 0) - s(1, -1, 0)) + absolute(s(2, 1, 0) - s(2, -1, 0)) +
+					absolute(s(0, 0, -1) - s(0, 0, 1)) + absolute(s(1, 0, -1) - s(1, 0, 1)) + absolute(s(2, 0, -1) - s(2, 0, 1))
+				);
+			}
+		};
+		// L1 norm of the 3 x 3 Sobel responses of every channel, which smooths noise across the gradient direction
+		struct sobel {
+			constexpr static bool global = false, diagonals = true, transitions = false;
+
+			template <typename S> inline static auto _response(const S &s, int c) -> decltype(s(c, 0, 0) - s(c, 0, 0)) {
+				auto gx =
+					(s(c, 1, -1) - s(c, -1, -1)) + 2 * (s(c, 1, 0) - s(c, -1, 0)) + (s(c, 1, 1) - s(c, -1, 1));
+				auto gy =
+					(s(c, -1, 1) - s(c, -1, -1)) + 2 * (s(c, 0, 1) - s(c, 0, -1)) + (s(c, 1, 1) - s(c, 1, -1));
+				return absolute(gx) + absolute(gy);
+			}
+			template <typename Real, typename S> inline static Real evaluate(const S &s) {
+				return static_cast<Real>(_response(s, 0) + _response(s, 1) + _response(s, 2));
+			}
+		};
+		// L1 gradient of the luma only, so that edges between colors of equal brightness cost nothing
+		struct luminance {
+			constexpr static bool global = false, diagonals = false, transitions = false;
+
+			template <typename S> inline static auto _luma(const S &s, int dx, int dy) -> decltype(s(0, 0, 0) - s(0, 0, 0)) {
+				return 77 * s(0, dx, dy) + 150 * s(1, dx, dy) + 29 * s(2, dx, dy);
+			}
+			template <typename Real, typename S> inline static Real evaluate(const S &s) {
+				return static_cast<Real>((absolute(_luma(s, 1, 0) - _luma(s, -1, 0)) + absolute(_luma(s, 0, -1) - _luma(s, 0, 1))) / 256);
+			}
+		};
+		// distance from the mean color of the image, which removes the most average looking pixels first
+		struct mean_color {
+			constexpr static bool global = true, diagonals = false, transitions = false;
+
+			template <typename Real, typename S> inline static Real evaluate(const S &s) {
+				return root<Real>(
+					squared(s.mean(0) - s(0, 0, 0)) + squared(s.mean(1) - s(1, 0, 0)) + squared(s.mean(2) - s(2, 0, 0))
+				);
+			}
+		};
+		// forward energy (Rubinstein et al. 2008): the pixels themselves cost nothing, a seam pays for the edges
+		// that removing it creates between pixels that become neighbors. transition_costs() reads s in seam space,
+		// dx along the line and dy = -1 on the line before, and writes the costs C_L, C_U and C_R of reaching the
+		// pixel from offsets -1, 0 and 1 of that line. The first line of a seam pays C_U
+		struct forward {
+			constexpr static bool global = false, diagonals = false, transitions = true;
+
+			template <typename S> inline static auto _distance(
+				const S &s, int dx1, int dy1, int dx2, int dy2
+			) -> decltype(s(0, 0, 0) - s(0, 0, 0)) {
+				return
+					absolute(s(0, dx1, dy1) - s(0, dx2, dy2)) + absolute(s(1, dx1, dy1) - s(1, dx2, dy2)) +
+					absolute(s(2, dx1, dy1) - s(2, dx2, dy2));
+			}
+			template <typename Real, typename S> inline static Real evaluate(const S&) {
+				return Real();
+			}
+			// at most 2 * 3 * 255 for u8 pixels, like l1
+			template <typename Real, typename S> inline static void transition_costs(const S &s, Real *costs) {
+				auto up = _distance(s, 1, 0, -1, 0);
+				costs[0] = static_cast<Real>(up + _distance(s, 0, -1, -1, 0));
+				costs[1] = static_cast<Real>(up);
+				costs[2] = static_cast<Real>(up + _distance(s, 0, -1, 1, 0));
+			}
+		};
+	}
+
+	// looks an energy type up in a table of Func::get<Policy>() for every policy, e.g. function pointers to a
+	// carver's kernels. The table is built once per Func, so selecting an energy at runtime costs one indirect call
+	template <typename Func> inline typename Func::result_type select_energy(energy_type type) {
+		static const typename Func::result_type table[] = {
+			Func::template get<energy_policy::gradient_l2>(),
+			Func::template get<energy_policy::squared_gradient>(),
+			Func::template get<energy_policy::l1>(),
+			Func::template get<energy_policy::sobel>(),
+			Func::template get<energy_policy::luminance>(),
+			Func::template get<energy_policy::mean_color>(),
+			Func::template get<energy_policy::forward>()
+		};
+		return table[static_cast<size_t>(type)];
+	}
+	struct energy_properties {
+		bool global, diagonals, transitions;
+
+		using result_type = energy_properties;
+		template <typename Policy> inline static energy_properties get() {
+			return {Policy::global, Policy::diagonals, Policy::transitions};
+		}
+	};
+	inline energy_properties get_energy_properties(energy_type type) {
+		return select_energy<energy_properties>(type);
+	}
+
+	// rows above, at and below the row being evaluated, as red, green and blue planes
+	template <typename T> struct energy_rows {
+		const T *up[3], *cur[3], *down[3];
+	};
+	// vectorized interiors of energy_row_kernel, specialized below for the types that have them
+	template <typename Policy, typename Real, typename T> struct energy_row_simd {
+		using body_func = void (*)(const energy_rows<T>&, const float*, Real*, size_t, size_t, size_t);
+
+		inline static body_func select(simd_level, body_func scalar) {
+			return scalar;
+		}
+	};
+
+	template <typename Policy, typename Real, typename T> struct energy_row_kernel {
+		using body_func = void (*)(const energy_rows<T>&, const float*, Real*, size_t, size_t, size_t);
+
+		struct sampler {
+			const energy_rows<T> &rows;
+			const float *means;
+			size_t l, x, r;
+
+			inline T operator()(int c, int dx, int dy) const {
+				const T *const *planes = dy < 0 ? rows.up : (dy > 0 ? rows.down : rows.cur);
+				return planes[c][dx < 0 ? l : (dx > 0 ? r : x)];
+			}
+			inline float mean(int c) const {
+				return means[c];
+			}
+		};
+
+		// computes the energies of columns [begin, end) of a row that is w pixels wide into dst[0, end - begin)
+		inline static void row(
+			const energy_rows<T> &rows, const float *mean, size_t w, Real *dst, size_t begin, size_t end
+		) {
+			size_t x = begin;
+			if (x == 0 && x < end) {
+				dst[0] = Policy::template evaluate<Real>(sampler{rows, mean, 0, 0, static_cast<size_t>(w > 1)});
+				++x;
+			}
+			size_t xend = std::min(end, w - 1);
+			if (x < xend) {
+				get_body()(rows, mean, dst, begin, x, xend);
+				x = xend;
+			}
+			if (x < end) {
+				dst[w - 1 - begin] = Policy::template evaluate<Real>(sampler{rows, mean, w - 2, w - 1, w - 1});
+			}
+		}
+
+		inline static body_func get_body() {
+			static const body_func func = energy_row_simd<Policy, Real, T>::select(get_simd_level(), body_scalar);
+			return func;
+		}
+		// columns [x, end) of the interior of row(), which only read the planes at fixed offsets from x
+		inline static void body_scalar(
+			const energy_rows<T> &rows, const float *mean, Real *dst, size_t begin, size_t x, size_t end
+		) {
+			for (; x < end; ++x) {
+				dst[x - begin] = Policy::template evaluate<Real>(sampler{rows, mean, x - 1, x, x + 1});
+			}
+		}
+	};
+	template <typename Policy, typename Real, typename T> void energy_row(
+		const energy_rows<T> &rows, const float *mean, size_t w, Real *dst, size_t begin, size_t end
+	) {
+		energy_row_kernel<Policy, Real, T>::row(rows, mean, w, dst, begin, end);
+	}
+	// Policy::transition_costs() for policies with transitions; the carvers never call it for the others
+	template <typename Policy, bool = Policy::transitions> struct transition_costs_of {
+		template <typename Real, typename S> inline static void get(const S&, Real*) {
+		}
+	};
+	template <typename Policy> struct transition_costs_of<Policy, true> {
+		template <typename Real, typename S> inline static void get(const S &s, Real *costs) {
+			Policy::template transition_costs<Real>(s, costs);
+		}
+	};
+	// the transition costs of columns [begin, end) of a line of a seam space that is w pixels wide into
+	// costs[k][0, end - begin), for predecessors at offset k - 1. rows.up is the line before, or the line itself on
+	// the first one; rows.down is not read
+	template <typename Policy, typename Real, typename T> void transition_row(
+		const energy_rows<T> &rows, size_t w, Real *const *costs, size_t begin, size_t end
+	) {
+		using sampler = typename energy_row_kernel<Policy, Real, T>::sampler;
+		for (size_t x = begin; x < end; ++x) {
+			Real c[3];
+			transition_costs_of<Policy>::template get<Real>(
+				sampler{rows, nullptr, x > 0 ? x - 1 : x, x, x + 1 < w ? x + 1 : x}, c
+			);
+			for (size_t k = 0; k < 3; ++k) {
+				costs[k][x - begin] = c[k];
+			}
+		}
+	}
+	// transition_row() for select_energy(), nullptr for policies without transitions
+	template <typename Real, typename T> struct transition_row_selector {
+		using result_type = void (*)(const energy_rows<T>&, size_t, Real *const*, size_t, size_t);
+
+		template <typename Policy> inline static result_type get() {
+			return Policy::transitions ? &transition_row<Policy, Real, T> : nullptr;
+		}
+	};
+
+	// The vector interior evaluates the policies on four float pixels at once, with the same IEEE operations as the
+	// scalar formula, so the energies are bit-identical. It is left out where compilers may fuse multiplies and adds
+	// (FMA targets), which they would do differently in the scalar and the vector code; they vectorize the scalar
+	// loop themselves there. It needs no target attribute, so it is also left out of 32-bit GCC builds without SSE2
+#if defined(SC_SIMD_X86) && (defined(_MSC_VER) || defined(__SSE2__)) && !defined(__FMA__)
+	struct energy_f32x4 {
+		__m128 v;
+
+		inline static energy_f32x4 load(const float *p) {
+			return {_mm_loadu_ps(p)};
+		}
+		inline static energy_f32x4 set(float v) {
+			return {_mm_set1_ps(v)};
+		}
+		inline void store(float *p) const {
+			_mm_storeu_ps(p, v);
+		}
+	};
+	inline energy_f32x4 operator+(energy_f32x4 a, energy_f32x4 b) {
+		return {_mm_add_ps(a.v, b.v)};
+	}
+	inline energy_f32x4 operator-(energy_f32x4 a, energy_f32x4 b) {
+		return {_mm_sub_ps(a.v, b.v)};
+	}
+	inline energy_f32x4 operator*(energy_f32x4 a, energy_f32x4 b) {
+		return {_mm_mul_ps(a.v, b.v)};
+	}
+	inline energy_f32x4 operator*(int a, energy_f32x4 b) {
+		return {_mm_mul_ps(_mm_set1_ps(static_cast<float>(a)), b.v)};
+	}
+	inline energy_f32x4 operator/(energy_f32x4 a, int b) {
+		return {_mm_div_ps(a.v, _mm_set1_ps(static_cast<float>(b)))};
+	}
+	// found by the policies through argument-dependent lookup
+	template <typename Real> inline energy_f32x4 root(energy_f32x4 v) {
+		return {_mm_sqrt_ps(v.v)};
+	}
+	inline energy_f32x4 absolute(energy_f32x4 v) {
+		return {_mm_andnot_ps(_mm_set1_ps(-0.0f), v.v)};
+	}
+
+	template <typename Policy> struct energy_row_simd<Policy, float, float> {
+		using body_func = void (*)(const energy_rows<float>&, const float*, float*, size_t, size_t, size_t);
+
+		inline static body_func select(simd_level level, body_func scalar) {
+			return level == simd_level::none ? scalar : body_sse2;
+		}
+
+		struct sampler {
+			const energy_rows<float> &rows;
+			energy_f32x4 means[3];
+			size_t x;
+
+			inline energy_f32x4 operator()(int c, int dx, int dy) const {
+				const float *const *planes = dy < 0 ? rows.up : (dy > 0 ? rows.down : rows.cur);
+				return energy_f32x4::load(planes[c] + x + dx);
+			}
+			inline energy_f32x4 mean(int c) const {
+				return means[c];
+			}
+		};
+		inline static void body_sse2(
+			const energy_rows<float> &rows, const float *mean, float *dst, size_t begin, size_t x, size_t end
+		) {
+			sampler s{rows, {energy_f32x4::set(mean[0]), energy_f32x4::set(mean[1]), energy_f32x4::set(mean[2])}, x};
+			for (; s.x + 4 <= end; s.x += 4) {
+				Policy::template evaluate<energy_f32x4>(s).store(dst + s.x - begin);
+			}
+			energy_row_kernel<Policy, float, float>::body_scalar(rows, mean, dst, begin, s.x, end);
+		}
+	};
+#endif
+}
@@ -1,2 +1,2 @@
-g++ main.cpp -o test -std=c++14 -O2 -lwindowscodecs -lgdi32 -lole32 -DUNICODE -D_UNICODE
+g++ main.cpp -o test -std=c++14 -O2 -pthread -lwindowscodecs -lgdi32 -lole32 -DUNICODE -D_UNICODE
 @pause
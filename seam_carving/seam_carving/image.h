@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <cstdint>
 
 #include "utils.h"
 
@@ -23,6 +24,11 @@ namespace seam_carving {
 	> cast_color_component(From v) {
 		return static_cast<To>(v);
 	}
+	template <typename To> inline std::enable_if_t<
+		std::is_same<To, unsigned char>::value, unsigned char
+	> cast_color_component(unsigned char v) {
+		return v;
+	}
 
 	template <typename T> struct color_component_limits {
 		constexpr static std::enable_if_t<std::is_floating_point<T>::value, T> min = 0.0, max = 1.0;
@@ -207,6 +213,153 @@ namespace seam_carving {
 		return result;
 	}
 
+	// one plane per channel with rows padded to a multiple of the alignment, so that loops over a row of one channel
+	// vectorize without gathers. The alpha plane is only allocated for images that need it, otherwise alpha reads
+	// as opaque
+	template <typename Elem> struct planar_image {
+	public:
+		using element_type = Elem;
+		using color_type = color_rgba<Elem>;
+		constexpr static size_t alignment = 64;
+
+		planar_image() = default;
+		planar_image(size_t w, size_t h, bool alpha) :
+			_w(w), _h(h), _stride((w * sizeof(Elem) + alignment - 1) / alignment * alignment / sizeof(Elem)),
+			_planes(alpha ? 4 : 3) {
+			if (_w > 0 && _h > 0) {
+				_raw = static_cast<char*>(std::malloc(sizeof(Elem) * _stride * _h * _planes + alignment));
+				_ps = reinterpret_cast<Elem*>((reinterpret_cast<std::uintptr_t>(_raw) + alignment - 1) & ~(alignment - 1));
+			} else {
+				_w = _h = _stride = 0;
+			}
+		}
+		planar_image(planar_image &&src) :
+			_raw(src._raw), _ps(src._ps), _w(src._w), _h(src._h), _stride(src._stride), _planes(src._planes) {
+			src._w = src._h = src._stride = 0;
+			src._raw = nullptr;
+			src._ps = nullptr;
+		}
+		planar_image(const planar_image &src) : planar_image(src._w, src._h, src.has_alpha()) {
+			if (_ps) {
+				std::memcpy(_ps, src._ps, sizeof(Elem) * _stride * _h * _planes);
+			}
+		}
+		planar_image &operator=(planar_image src) {
+			std::swap(_raw, src._raw);
+			std::swap(_ps, src._ps);
+			std::swap(_w, src._w);
+			std::swap(_h, src._h);
+			std::swap(_stride, src._stride);
+			std::swap(_planes, src._planes);
+			return *this;
+		}
+		~planar_image() {
+			if (_raw) {
+				std::free(_raw);
+			}
+		}
+
+		size_t width() const {
+			return _w;
+		}
+		size_t height() const {
+			return _h;
+		}
+		// distance between two rows of a plane, in elements
+		size_t stride() const {
+			return _stride;
+		}
+		size_t planes() const {
+			return _planes;
+		}
+		bool has_alpha() const {
+			return _planes == 4;
+		}
+
+		// channels are numbered r, g, b, a
+		Elem *row(size_t c, size_t y) {
+			assert(c < _planes && y < _h);
+			return _ps + (c * _h + y) * _stride;
+		}
+		const Elem *row(size_t c, size_t y) const {
+			assert(c < _planes && y < _h);
+			return _ps + (c * _h + y) * _stride;
+		}
+
+		color_type get(size_t x, size_t y) const {
+			assert(x < _w && y < _h);
+			Elem opaque = color_type::component_limits::max;
+			return color_type(row(0, y)[x], row(1, y)[x], row(2, y)[x], has_alpha() ? row(3, y)[x] : opaque);
+		}
+		void set(size_t x, size_t y, const color_type &c) {
+			assert(x < _w && y < _h);
+			row(0, y)[x] = c.r;
+			row(1, y)[x] = c.g;
+			row(2, y)[x] = c.b;
+			if (has_alpha()) {
+				row(3, y)[x] = c.a;
+			}
+		}
+	protected:
+		char *_raw = nullptr;
+		Elem *_ps = nullptr;
+		size_t _w = 0, _h = 0, _stride = 0, _planes = 3;
+	};
+
+	// the result only has an alpha plane if some pixel is not opaque
+	template <typename To, typename From> void planar_cast(const image<color_rgba<From>> &img, planar_image<To> &result) {
+		bool alpha = false;
+		for (size_t i = 0; i < img.width() * img.height() && !alpha; ++i) {
+			alpha = img.data()[i].a != color_rgba<From>::component_limits::max;
+		}
+		result = planar_image<To>(img.width(), img.height(), alpha);
+		for (size_t y = 0; y < img.height(); ++y) {
+			const color_rgba<From> *src = img.at_y(y);
+			To *r = result.row(0, y), *g = result.row(1, y), *b = result.row(2, y), *a = alpha ? result.row(3, y) : nullptr;
+			for (size_t x = 0; x < img.width(); ++x) {
+				r[x] = cast_color_component<To>(src[x].r);
+				g[x] = cast_color_component<To>(src[x].g);
+				b[x] = cast_color_component<To>(src[x].b);
+				if (a) {
+					a[x] = cast_color_component<To>(src[x].a);
+				}
+			}
+		}
+	}
+	// converts the top left w x h pixels of a planar image. If removed is given, it lists the columns of the
+	// removed_count elements of each row that are not pixels, in increasing order, like in rows carved with lazy
+	// compaction; the list of row y starts at removed[y * stride]
+	template <typename To, typename From> void planar_cast(
+		const planar_image<From> &img, size_t w, size_t h, const size_t *removed, size_t stride, size_t removed_count,
+		image<color_rgba<To>> &result
+	) {
+		assert(w + removed_count <= img.width() && h <= img.height());
+		if (result.width() != w || result.height() != h) {
+			result = image<color_rgba<To>>(w, h);
+		}
+		const To opaque = color_rgba<To>::component_limits::max;
+		for (size_t y = 0; y < h; ++y) {
+			color_rgba<To> *dst = result.at_y(y);
+			const From *r = img.row(0, y), *g = img.row(1, y), *b = img.row(2, y);
+			const From *a = img.has_alpha() ? img.row(3, y) : nullptr;
+			const size_t *skip = removed ? removed + y * stride : nullptr, *skipend = removed ? skip + removed_count : nullptr;
+			for (size_t x = 0, sx = 0; x < w; ++x, ++sx) {
+				for (; skip != skipend && *skip == sx; ++skip) {
+					++sx;
+				}
+				dst[x] = color_rgba<To>(
+					cast_color_component<To>(r[sx]), cast_color_component<To>(g[sx]), cast_color_component<To>(b[sx]),
+					a ? cast_color_component<To>(a[sx]) : opaque
+				);
+			}
+		}
+	}
+	template <typename To, typename From> void planar_cast(
+		const planar_image<From> &img, size_t w, size_t h, image<color_rgba<To>> &result
+	) {
+		planar_cast(img, w, h, nullptr, 0, 0, result);
+	}
+
 	struct image_io {
 	public:
 		image_io() {
@@ -1,10 +1,12 @@
 #include <utility>
 #include <chrono>
 #include <cstdio>
+#include <cstdlib>
 
 #include "window.h"
 #include "carver.h"
 #include "dancing_link_carver.h"
+#include "seam_map_file.h"
 
 using namespace seam_carving;
 
@@ -31,21 +33,16 @@ enum class enlarge_status {
 };
 struct image_enlarger {
 public:
-	void prepare(retargeter_t::enlarge_table_t tbl, enlarge_status t) {
+	void prepare(retargeter_t::compact_enlarge_table tbl, enlarge_status t) {
 		table = std::move(tbl);
-		repeat = dynamic_array2<bool>(orig_img.width(), orig_img.height());
-		repeat.memset(false);
 		enlarged_size = 0;
 		type = t;
 	}
 
 	bool can_enlarge() const {
-		return enlarged_size < table.size();
+		return enlarged_size < table.seams;
 	}
 	void enlarge() {
-		for (auto &&pair : table[enlarged_size]) {
-			repeat.at(pair.first, pair.second) = true;
-		}
 		++enlarged_size;
 	}
 	bool can_shrink() const {
@@ -53,9 +50,6 @@ public:
 	}
 	void shrink() {
 		--enlarged_size;
-		for (auto &&pair : table[enlarged_size]) {
-			repeat.at(pair.first, pair.second) = false;
-		}
 	}
 	void retarget(size_t w, size_t h) {
 		size_t ev = 0, et = 0;
@@ -78,31 +72,13 @@ public:
 	}
 
 	sys_image get_sys_image(HDC dc) const {
-		return type == enlarge_status::horizontal ? get_sys_image_horizontal(dc) : get_sys_image_vertical(dc);
-	}
-	image_rgba_u8 get_image() const {
-		return type == enlarge_status::horizontal ? get_image_horizontal() : get_image_vertical();
-	}
-
-	sys_image get_sys_image_horizontal(HDC dc) const {
-		sys_image img(dc, orig_img.width() + enlarged_size, orig_img.height());
-		_get_image_horizontal_impl(img);
+		sys_image img(dc, current_width(), current_height());
+		retargeter_t::enlarge_with_table(orig_img, table, enlarged_size, img);
 		return img;
 	}
-	image_rgba_u8 get_image_horizontal() const {
-		image_rgba_u8 img(orig_img.width() + enlarged_size, orig_img.height());
-		_get_image_horizontal_impl(img);
-		return img;
-	}
-
-	sys_image get_sys_image_vertical(HDC dc) const {
-		sys_image img(dc, orig_img.width(), orig_img.height() + enlarged_size);
-		_get_image_vertical_impl(img);
-		return img;
-	}
-	image_rgba_u8 get_image_vertical() const {
-		image_rgba_u8 img(orig_img.width(), orig_img.height() + enlarged_size);
-		_get_image_vertical_impl(img);
+	image_rgba_u8 get_image() const {
+		image_rgba_u8 img(current_width(), current_height());
+		retargeter_t::enlarge_with_table(orig_img, table, enlarged_size, img);
 		return img;
 	}
 
@@ -113,36 +89,9 @@ public:
 		return orig_img.height() + (type == enlarge_status::vertical ? enlarged_size : 0);
 	}
 
-	retargeter_t::enlarge_table_t table;
-	dynamic_array2<bool> repeat;
+	retargeter_t::compact_enlarge_table table;
 	size_t enlarged_size = 0;
 	enlarge_status type = enlarge_status::none;
-protected:
-	template <typename Img> void _get_image_horizontal_impl(Img &img) const {
-		for (size_t y = 0; y < orig_img.height(); ++y) {
-			const color_rgba_u8 *src = orig_img.at_y(y);
-			typename Img::element_type *dst = img.at_y(y);
-			const bool *rep = repeat.at_y(y);
-			for (size_t x = 0; x < orig_img.width(); ++x, ++src, ++dst, ++rep) {
-				*dst = typename Img::element_type(*src);
-				if (*rep) {
-					dst[1] = dst[0];
-					++dst;
-				}
-			}
-		}
-	}
-	template <typename Img> void _get_image_vertical_impl(Img &img) const {
-		for (size_t x = 0; x < orig_img.width(); ++x) {
-			for (size_t y = 0, dy = 0; y < orig_img.height(); ++y, ++dy) {
-				img.at(x, dy) = typename Img::element_type(orig_img.at(x, y));
-				if (repeat.at(x, y)) {
-					img.at(x, dy + 1) = img.at(x, dy);
-					++dy;
-				}
-			}
-		}
-	}
 };
 
 image_enlarger enlarger;
@@ -151,9 +100,15 @@ image_enlarger enlarger;
 bool show_help = true, show_compensation = true;
 size_t brush_rad = 10, lastx = 0, lasty = 0;
 
+const char *const energy_names[] = {
+	"gradient", "squared gradient", "L1 gradient", "Sobel", "luminance", "mean color", "forward"
+};
+constexpr size_t energy_count = sizeof(energy_names) / sizeof(*energy_names);
+
 constexpr char help_message[] =
 "F1: Toggle help message\n"
 "C: Toggle show favored / excluded regions (currently %s)\n"
+"E: Cycle energy function (currently %s)\n"
 "\n"
 "R: Reset image\n"
 "S: Set current image as original\n"
@@ -250,19 +205,19 @@ void paint_compensate_region(size_t x1, size_t y1, size_t x2, size_t y2, retarge
 		xmin = std::max(std::min(x1, x2), brush_rad) - brush_rad,
 		xmax = std::min(std::max(x1, x2) + brush_rad + 1, retargeter.current_width());
 	retargeter_t::ptr_t ynode = retargeter.at(xmin, ymin);
-	for (size_t yp = ymin; yp < ymax; ++yp, ynode = retargeter.deref(ynode).down) {
+	for (size_t yp = ymin; yp < ymax; ++yp, ynode = retargeter.get_links(ynode).down) {
 		bool had = false;
 		retargeter_t::ptr_t curptr = ynode;
-		for (size_t xp = xmin; xp < xmax; ++xp, curptr = retargeter.deref(curptr).right) {
+		for (size_t xp = xmin; xp < xmax; ++xp, curptr = retargeter.get_links(curptr).right) {
 			if (hit_test_capsule<long long>(x1, y1, x2, y2, xp, yp, brush_rad)) {
-				retargeter.deref(curptr).compensation = v;
+				retargeter.set_compensation(curptr, v);
 				had = true;
 			} else if (had) {
 				break;
 			}
 		}
 	}
-	retargeter.invalidate_dp_values();
+	retargeter.invalidate_dp_region(xmin, ymin, xmax, ymax);
 	refresh_displayed_image(true);
 }
 #endif
@@ -292,7 +247,8 @@ LRESULT CALLBACK main_window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lpa
 				char tmp[1000];
 				std::snprintf(
 					tmp, sizeof(tmp), help_message,
-					show_compensation ? "on" : "off", static_cast<unsigned>(brush_rad)
+					show_compensation ? "on" : "off", energy_names[static_cast<size_t>(retargeter.get_energy())],
+					static_cast<unsigned>(brush_rad)
 				);
 				DrawTextA(bdc, tmp, -1, &nr, DT_TOP | DT_LEFT);
 			}
@@ -339,6 +295,10 @@ LRESULT CALLBACK main_window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lpa
 				show_compensation = !show_compensation;
 				refresh_displayed_image(true);
 				break;
+			case 'E':
+				retargeter.set_energy(static_cast<energy_type>((static_cast<size_t>(retargeter.get_energy()) + 1) % energy_count));
+				main_window.invalidate_visual();
+				break;
 
 			case 'R':
 #ifdef USE_DL_CARVER
@@ -390,7 +350,7 @@ LRESULT CALLBACK main_window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lpa
 					auto begt = now();
 					set_cursor(OCR_WAIT);
 					retargeter.reset_updated_node_count();
-					enlarger.prepare(retargeter.prepare_horizontal_enlarging(), enlarge_status::horizontal);
+					enlarger.prepare(retargeter.prepare_horizontal_enlarging_compact(), enlarge_status::horizontal);
 					float dur = std::chrono::duration<float>(now() - begt).count();
 					char msg[100];
 					unsigned tot = static_cast<unsigned>(
@@ -411,7 +371,7 @@ LRESULT CALLBACK main_window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lpa
 					auto begt = now();
 					set_cursor(OCR_WAIT);
 					retargeter.reset_updated_node_count();
-					enlarger.prepare(retargeter.prepare_vertical_enlarging(), enlarge_status::vertical);
+					enlarger.prepare(retargeter.prepare_vertical_enlarging_compact(), enlarge_status::vertical);
 					float dur = std::chrono::duration<float>(now() - begt).count();
 					char msg[100];
 					unsigned tot = static_cast<unsigned>(
@@ -489,16 +449,88 @@ LPWSTR convert_to_widechar(const char *cs) {
 	return str;
 }
 
-class simple_retargeter_benchmark : public simple_retargeter {
+// time spent on bookkeeping that should not be part of the measurement, and extra lines to print
+struct benchmark_extras {
+	double untimed() const {
+		return 0.0;
+	}
+	void print_extra() const {
+	}
+};
+class simple_retargeter_benchmark : public simple_retargeter, public benchmark_extras {
 public:
 	void carve_vertical(const simple_retargeter::carve_path_pixel_data &data) {
 		simple_retargeter::carve_vertical_in_situ(data);
 	}
 	unsigned long long additional_data() const {
-		return 0;
+		return simple_retargeter::get_updated_cell_count();
+	}
+};
+class simple_retargeter_u8_benchmark : public simple_retargeter_u8, public benchmark_extras {
+public:
+	void carve_vertical(const simple_retargeter_u8::carve_path_pixel_data &data) {
+		simple_retargeter_u8::carve_vertical_in_situ(data);
+	}
+	unsigned long long additional_data() const {
+		return simple_retargeter_u8::get_updated_cell_count();
 	}
 };
-class dancing_link_retargeter_benchmark : public dancing_link_retargeter {
+class fused_retargeter_benchmark : public simple_retargeter_benchmark {
+public:
+	fused_retargeter_benchmark() {
+		set_fused_energy(true);
+	}
+};
+class lazy_retargeter_benchmark : public simple_retargeter_benchmark {
+public:
+	lazy_retargeter_benchmark() {
+		set_lazy_compaction(16);
+	}
+};
+// carves with the pyramid search, and also finds the exact seam each time (untimed) to compare the energies
+class pyramid_retargeter_benchmark : public simple_retargeter {
+public:
+	pyramid_retargeter_benchmark() {
+		set_pyramid_search(levels, band);
+	}
+
+	static size_t levels, band;
+
+	carve_path_pixel_data get_vertical_carve_path() {
+		carve_path_pixel_data path = simple_retargeter::get_vertical_carve_path();
+		auto begt = now();
+		size_t cells = _updated_cells;
+		set_pyramid_search(0);
+		carve_path_pixel_data exact = simple_retargeter::get_vertical_carve_path();
+		set_pyramid_search(levels, band);
+		_updated_cells = cells;
+		_exact_energy += get_vertical_seam_energy(exact.data());
+		_found_energy += get_vertical_seam_energy(path.data());
+		_untimed += std::chrono::duration<double, std::milli>(now() - begt).count();
+		return path;
+	}
+	void carve_vertical(const carve_path_pixel_data &data) {
+		simple_retargeter::carve_vertical_in_situ(data);
+	}
+	unsigned long long additional_data() const {
+		return simple_retargeter::get_updated_cell_count();
+	}
+	double untimed() const {
+		return _untimed;
+	}
+	void print_extra() const {
+		printf(
+			"levels %u band %u: seam energy %lf, exact %lf (+%lf%%)\n",
+			static_cast<unsigned>(levels), static_cast<unsigned>(band), _found_energy, _exact_energy,
+			100.0 * (_found_energy - _exact_energy) / _exact_energy
+		);
+	}
+protected:
+	double _found_energy = 0.0, _exact_energy = 0.0, _untimed = 0.0;
+};
+size_t pyramid_retargeter_benchmark::levels = 3, pyramid_retargeter_benchmark::band = 4;
+
+class dancing_link_retargeter_benchmark : public dancing_link_retargeter, public benchmark_extras {
 public:
 	void carve_vertical(dancing_link_retargeter::ptr_t path) {
 		dancing_link_retargeter::carve_path_vertical(path);
@@ -507,6 +539,45 @@ public:
 		return dancing_link_retargeter::get_updated_node_count();
 	}
 };
+// carves with the default energy, and checks (untimed) after every seam that the energy of each node is still the
+// original one, the squared gradient of colors normalized to [0, 1], so that the seams are those of the original
+// carver
+class dancing_link_reference_benchmark : public dancing_link_retargeter_benchmark {
+public:
+	void carve_vertical(dancing_link_retargeter::ptr_t path) {
+		dancing_link_retargeter_benchmark::carve_vertical(path);
+		auto begt = now();
+		_check();
+		_untimed += std::chrono::duration<double, std::milli>(now() - begt).count();
+	}
+	double untimed() const {
+		return _untimed;
+	}
+	void print_extra() const {
+		printf("%llu of %llu node energies differ from the original\n", _mismatches, _checked);
+	}
+protected:
+	unsigned long long _mismatches = 0, _checked = 0;
+	double _untimed = 0.0;
+
+	color_rgba_f _neighbor_color(ptr_t p, ptr_t n) const {
+		return get_color(n == null ? p : n).cast<float>();
+	}
+	void _check() {
+		for (ptr_t y = at(0, 0); y != null; y = get_links(y).down) {
+			for (ptr_t x = y; x != null; x = get_links(x).right, ++_checked) {
+				const node_links &ln = get_links(x);
+				color_rgba_f
+					hd = _neighbor_color(x, ln.right) - _neighbor_color(x, ln.left),
+					vd = _neighbor_color(x, ln.down) - _neighbor_color(x, ln.up);
+				real_t energy = squared(hd.r) + squared(hd.g) + squared(hd.b) + squared(vd.r) + squared(vd.g) + squared(vd.b);
+				if (get_node_energy(x) != energy) {
+					++_mismatches;
+				}
+			}
+		}
+	}
+};
 
 template <typename Ret> void benchmark_retargeter(const char *fn) {
 	LPWSTR wfn = convert_to_widechar(fn);
@@ -520,12 +591,55 @@ template <typename Ret> void benchmark_retargeter(const char *fn) {
 	for (size_t i = 0; i < targetsize; ++i) {
 		ret.carve_vertical(ret.get_vertical_carve_path());
 	}
-	double dur = std::chrono::duration<double, std::milli>(now() - begt).count();
+	double dur = std::chrono::duration<double, std::milli>(now() - begt).count() - ret.untimed();
 	printf(
 		"%u %u %lf %llu\n",
 		static_cast<unsigned>(img.width()), static_cast<unsigned>(img.height()),
 		dur, ret.additional_data()
 	);
+	ret.print_extra();
+}
+
+// serves every width down to half the image from a removal rank map, which is taken from mapfn if it has been
+// saved there for this image, and computed and saved there otherwise
+void benchmark_seam_map(const char *fn, const char *mapfn) {
+	LPWSTR wfn = convert_to_widechar(fn), wmapfn = convert_to_widechar(mapfn);
+	image_io loader;
+	image_rgba_u8 img = loader.load_image(wfn);
+	size_t min_width = std::max<size_t>(img.width() / 2, 2);
+	auto begt = now();
+	seam_map_file file;
+	removal_rank_map computed;
+	removal_rank_view map;
+	bool loaded =
+		file.open(wmapfn) && file.kind() == seam_map_kind::removal && file.matches(img) &&
+		file.removal_ranks().orient == orientation::vertical && img.width() - file.removal_ranks().seams <= min_width;
+	if (loaded) {
+		map = file.removal_ranks();
+	} else {
+		file.close();
+		simple_retargeter ret;
+		ret.set_image(img);
+		computed = ret.compute_removal_ranks(orientation::vertical, min_width);
+		if (!seam_map_file::save(wmapfn, computed, hash_image(img))) {
+			printf("cannot save %s\n", mapfn);
+		}
+		map = computed.view();
+	}
+	double prepare = std::chrono::duration<double, std::milli>(now() - begt).count();
+	delete[] wfn;
+	delete[] wmapfn;
+	begt = now();
+	size_t sizes = 0;
+	for (size_t size = img.width(); size >= min_width; --size, ++sizes) {
+		simple_retargeter::retarget_with_ranks(img, map, size);
+	}
+	double dur = std::chrono::duration<double, std::milli>(now() - begt).count();
+	printf(
+		"%u %u: map %s in %lf ms, %u sizes in %lf ms\n",
+		static_cast<unsigned>(img.width()), static_cast<unsigned>(img.height()), loaded ? "loaded" : "computed",
+		prepare, static_cast<unsigned>(sizes), dur
+	);
 }
 
 int main(int argc, char **argv) {
@@ -534,14 +648,40 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
-	if (argc == 3) {
+	if (argc >= 3) {
 		switch (argv[1][0]) {
 		case 'o':
 			benchmark_retargeter<simple_retargeter_benchmark>(argv[2]);
 			break;
+		case 'u':
+			benchmark_retargeter<simple_retargeter_u8_benchmark>(argv[2]);
+			break;
 		case 'd':
 			benchmark_retargeter<dancing_link_retargeter_benchmark>(argv[2]);
 			break;
+		case 'r':
+			benchmark_retargeter<dancing_link_reference_benchmark>(argv[2]);
+			break;
+		case 'f':
+			benchmark_retargeter<fused_retargeter_benchmark>(argv[2]);
+			break;
+		case 'l':
+			benchmark_retargeter<lazy_retargeter_benchmark>(argv[2]);
+			break;
+		case 'p':
+			// p <file> [levels] [band]
+			if (argc > 3) {
+				pyramid_retargeter_benchmark::levels = static_cast<size_t>(std::atoi(argv[3]));
+			}
+			if (argc > 4) {
+				pyramid_retargeter_benchmark::band = static_cast<size_t>(std::atoi(argv[4]));
+			}
+			benchmark_retargeter<pyramid_retargeter_benchmark>(argv[2]);
+			break;
+		case 'm':
+			// m <file> [map file]
+			benchmark_seam_map(argv[2], argc > 3 ? argv[3] : "seam_map.scm");
+			break;
 		}
 	} else {
 		main_window = window(
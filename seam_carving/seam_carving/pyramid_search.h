@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cassert>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+namespace seam_carving {
+	// coarse-to-fine search for a top-to-bottom seam. The energy map is halved in both directions up to levels
+	// times and the seam is found exactly on the coarsest map; every finer level then only evaluates a window of
+	// band pixels on either side of the upsampled seam. Ties are broken like dp_row_kernel, leftmost first.
+	template <typename T> class basic_pyramid_seam_search {
+	public:
+		using real_t = T;
+
+		void set_levels(size_t levels) {
+			_levels = levels;
+		}
+		size_t get_levels() const {
+			return _levels;
+		}
+		void set_band(size_t band) {
+			_band = std::max<size_t>(band, 1);
+		}
+		size_t get_band() const {
+			return _band;
+		}
+
+		// writes the seam through the w x h map to path (h elements) and returns the number of evaluated cells
+		size_t find(const real_t *energy, size_t stride, size_t w, size_t h, size_t *path) {
+			assert(w > 1 && h > 1);
+			_build(energy, stride, w, h);
+			size_t cells = 0;
+			// exact seam on the coarsest map
+			map_level top = _maps.empty() ? map_level{energy, stride, w, h} : _maps.back().view();
+			_lo.assign(top.h, 0);
+			_hi.assign(top.h, top.w - 1);
+			_path.resize(top.h);
+			cells += _banded_dp(top, _path.data());
+			for (size_t i = _maps.size(); i > 0; --i) {
+				map_level fine = i > 1 ? _maps[i - 2].view() : map_level{energy, stride, w, h};
+				_lo.resize(fine.h);
+				_hi.resize(fine.h);
+				std::swap(_path, _coarse_path);
+				for (size_t y = 0; y < fine.h; ++y) {
+					size_t center = std::min(_coarse_path[y / 2] * 2, fine.w - 1);
+					_lo[y] = center > _band ? center - _band : 0;
+					_hi[y] = std::min(center + 1 + _band, fine.w - 1);
+				}
+				_path.resize(fine.h);
+				cells += _banded_dp(fine, _path.data());
+			}
+			std::copy(_path.begin(), _path.begin() + h, path);
+			return cells;
+		}
+	protected:
+		struct map_level {
+			const real_t *data;
+			size_t stride, w, h;
+		};
+		struct owned_level {
+			std::vector<real_t> data;
+			size_t w = 0, h = 0;
+
+			map_level view() const {
+				return {data.data(), w, w, h};
+			}
+		};
+
+		size_t _levels = 0, _band = 4;
+		// downsampled maps, finest first; the vectors keep their capacity between seams
+		std::vector<owned_level> _maps;
+		std::vector<real_t> _dp;
+		std::vector<signed char> _dirs;
+		std::vector<size_t> _lo, _hi, _offset, _path, _coarse_path;
+
+		// each coarse cell is the mean of the 2 x 2 fine cells it covers, repeating the last row / column of odd sizes
+		void _build(const real_t *energy, size_t stride, size_t w, size_t h) {
+			size_t count = 0;
+			for (size_t cw = w, ch = h; count < _levels && (cw + 1) / 2 > 1 && (ch + 1) / 2 > 1; ++count) {
+				cw = (cw + 1) / 2;
+				ch = (ch + 1) / 2;
+			}
+			if (_maps.size() < count) {
+				_maps.resize(count);
+			}
+			_maps.erase(_maps.begin() + count, _maps.end());
+			map_level src{energy, stride, w, h};
+			for (owned_level &dst : _maps) {
+				dst.w = (src.w + 1) / 2;
+				dst.h = (src.h + 1) / 2;
+				dst.data.resize(dst.w * dst.h);
+				for (size_t y = 0; y < dst.h; ++y) {
+					const real_t *r0 = src.data + 2 * y * src.stride, *r1 = 2 * y + 1 < src.h ? r0 + src.stride : r0;
+					real_t *out = dst.data.data() + y * dst.w;
+					for (size_t x = 0; x < dst.w; ++x) {
+						size_t x1 = std::min(2 * x + 1, src.w - 1);
+						out[x] = (r0[2 * x] + r0[x1] + r1[2 * x] + r1[x1]) / 4;
+					}
+				}
+				src = dst.view();
+			}
+		}
+		// DP over the cells [_lo[y], _hi[y]] of every row; cells outside the windows are unreachable
+		size_t _banded_dp(const map_level &map, size_t *path) {
+			const real_t inf = std::numeric_limits<real_t>::has_infinity ?
+				std::numeric_limits<real_t>::infinity() : std::numeric_limits<real_t>::max();
+			_offset.resize(map.h + 1);
+			_offset[0] = 0;
+			for (size_t y = 0; y < map.h; ++y) {
+				_offset[y + 1] = _offset[y] + (_hi[y] - _lo[y] + 1);
+			}
+			_dp.resize(_offset[map.h]);
+			_dirs.resize(_offset[map.h]);
+			const real_t *erow = map.data;
+			for (size_t x = _lo[0]; x <= _hi[0]; ++x) {
+				_dp[x - _lo[0]] = erow[x];
+			}
+			for (size_t y = 1; y < map.h; ++y) {
+				erow = map.data + y * map.stride;
+				size_t plo = _lo[y - 1], phi = _hi[y - 1];
+				const real_t *last = _dp.data() + _offset[y - 1];
+				real_t *cur = _dp.data() + _offset[y];
+				signed char *dir = _dirs.data() + _offset[y];
+				for (size_t x = _lo[y]; x <= _hi[y]; ++x, ++cur, ++dir) {
+					real_t e = erow[x], best = inf;
+					signed char d = 0;
+					for (int k = -1; k <= 1; ++k) {
+						if ((k < 0 && x == 0) || x + k < plo || x + k > phi || last[x + k - plo] == inf) {
+							continue;
+						}
+						real_t v = last[x + k - plo] + e;
+						if (v < best) {
+							best = v;
+							d = static_cast<signed char>(k);
+						}
+					}
+					*cur = best;
+					*dir = d;
+				}
+			}
+			size_t y = map.h - 1, lo = _lo[y];
+			const real_t *cur = _dp.data() + _offset[y];
+			size_t best = 0;
+			for (size_t i = 1; i <= _hi[y] - lo; ++i) {
+				if (cur[i] < cur[best]) {
+					best = i;
+				}
+			}
+			path[y] = lo + best;
+			for (; y > 0; --y) {
+				path[y - 1] = path[y] + _dirs[_offset[y] + path[y] - _lo[y]];
+			}
+			return _offset[map.h];
+		}
+	};
+	using pyramid_seam_search = basic_pyramid_seam_search<float>;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+#include "utils.h"
+#include "image.h"
+#include "carver.h"
+#include "dancing_link_carver.h"
+
+namespace seam_carving {
+	enum class seam_map_kind : std::uint32_t {
+		removal = 0, // removal_rank_map, 32-bit ranks
+		enlarge = 1 // dancing_link_retargeter::compact_enlarge_table, 16-bit ranks
+	};
+
+	// file layout: this header followed by width * height ranks at data_offset, row by row, in native (little endian)
+	// byte order. The ranks are used in place from the mapped file, so a size that has been computed once costs
+	// one mapping and one pass over the image afterwards
+	struct seam_map_header {
+		constexpr static std::uint32_t current_version = 1;
+
+		inline static const char *magic_value() {
+			return "SCSEAMAP";
+		}
+
+		char magic[8];
+		std::uint32_t version, kind, orient, rank_bytes;
+		std::uint64_t width, height, seams, content_hash, data_offset;
+	};
+	static_assert(sizeof(seam_map_header) == 64, "seam map header must not be padded");
+
+	// identifies the source image of a seam map; the dimensions are hashed along with the pixels
+	inline std::uint64_t hash_image(const image_rgba_u8 &img) {
+		const std::uint64_t prime = 0x100000001b3ull;
+		std::uint64_t h = 0xcbf29ce484222325ull;
+		h = (h ^ img.width()) * prime;
+		h = (h ^ img.height()) * prime;
+		const unsigned char *data = reinterpret_cast<const unsigned char*>(img.data());
+		size_t bytes = sizeof(color_rgba_u8) * img.width() * img.height(), i = 0;
+		for (; i + 8 <= bytes; i += 8) {
+			std::uint64_t word;
+			std::memcpy(&word, data + i, 8);
+			h = (h ^ word) * prime;
+			h ^= h >> 29;
+		}
+		for (; i < bytes; ++i) {
+			h = (h ^ data[i]) * prime;
+		}
+		return h;
+	}
+
+	// a read-only mapping of a seam map file. The views returned point into the mapping and are valid until the
+	// file is closed
+	class seam_map_file {
+	public:
+		seam_map_file() = default;
+		seam_map_file(const seam_map_file&) = delete;
+		seam_map_file &operator=(const seam_map_file&) = delete;
+		~seam_map_file() {
+			close();
+		}
+
+		static bool save(LPCWSTR filename, const removal_rank_map &map, std::uint64_t content_hash) {
+			return _save(
+				filename, seam_map_kind::removal, map.orient, map.width, map.height, map.seams, content_hash,
+				map.ranks.data(), sizeof(std::uint32_t)
+			);
+		}
+		static bool save(
+			LPCWSTR filename, const dancing_link_retargeter::compact_enlarge_table &table, std::uint64_t content_hash
+		) {
+			return _save(
+				filename, seam_map_kind::enlarge, table.orient, table.width, table.height, table.seams, content_hash,
+				table.ranks.data(), sizeof(dancing_link_retargeter::enlarge_rank_t)
+			);
+		}
+
+		// fails for missing files, for files that are truncated or written by another version, and for headers that
+		// do not describe a valid map. The ranks themselves are not checked; the functions that serve images from
+		// them never write outside the images, whatever they hold
+		bool open(LPCWSTR filename) {
+			close();
+			_file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (_file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(_file, &size) || static_cast<std::uint64_t>(size.QuadPart) < sizeof(seam_map_header)) {
+				close();
+				return false;
+			}
+			_mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (_mapping != nullptr) {
+				_view = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+			}
+			if (_view == nullptr || !_validate(static_cast<std::uint64_t>(size.QuadPart))) {
+				close();
+				return false;
+			}
+			return true;
+		}
+		void close() {
+			if (_view != nullptr) {
+				SC_WINAPI_CHECK(UnmapViewOfFile(_view));
+				_view = nullptr;
+			}
+			if (_mapping != nullptr) {
+				SC_WINAPI_CHECK(CloseHandle(_mapping));
+				_mapping = nullptr;
+			}
+			if (_file != INVALID_HANDLE_VALUE) {
+				SC_WINAPI_CHECK(CloseHandle(_file));
+				_file = INVALID_HANDLE_VALUE;
+			}
+		}
+		bool is_open() const {
+			return _view != nullptr;
+		}
+
+		const seam_map_header &header() const {
+			assert(is_open());
+			return *static_cast<const seam_map_header*>(_view);
+		}
+		seam_map_kind kind() const {
+			return static_cast<seam_map_kind>(header().kind);
+		}
+		bool matches(const image_rgba_u8 &img) const {
+			return header().width == img.width() && header().height == img.height() && header().content_hash == hash_image(img);
+		}
+
+		removal_rank_view removal_ranks() const {
+			assert(kind() == seam_map_kind::removal);
+			return {
+				static_cast<orientation>(header().orient), _size(header().width), _size(header().height),
+				_size(header().seams), static_cast<const std::uint32_t*>(_data())
+			};
+		}
+		dancing_link_retargeter::compact_enlarge_view enlarge_ranks() const {
+			assert(kind() == seam_map_kind::enlarge);
+			return {
+				static_cast<orientation>(header().orient), _size(header().width), _size(header().height),
+				_size(header().seams), static_cast<const dancing_link_retargeter::enlarge_rank_t*>(_data())
+			};
+		}
+	protected:
+		HANDLE _file = INVALID_HANDLE_VALUE, _mapping = nullptr;
+		const void *_view = nullptr;
+
+		inline static size_t _size(std::uint64_t v) {
+			return static_cast<size_t>(v);
+		}
+		const void *_data() const {
+			return static_cast<const unsigned char*>(_view) + header().data_offset;
+		}
+		bool _validate(std::uint64_t file_size) const {
+			const seam_map_header &hdr = header();
+			if (std::memcmp(hdr.magic, seam_map_header::magic_value(), sizeof(hdr.magic)) != 0 ||
+				hdr.version != seam_map_header::current_version) {
+				return false;
+			}
+			if (hdr.orient > static_cast<std::uint32_t>(orientation::vertical)) {
+				return false;
+			}
+			// removal maps leave at least one pixel in each row (vertical) or column (horizontal), and enlarge
+			// tables hold at most one seam for each pixel that can be duplicated
+			std::uint32_t rank_bytes;
+			std::uint64_t max_seams;
+			switch (static_cast<seam_map_kind>(hdr.kind)) {
+			case seam_map_kind::removal:
+				rank_bytes = sizeof(std::uint32_t);
+				max_seams = (hdr.orient == static_cast<std::uint32_t>(orientation::vertical) ? hdr.width : hdr.height) - 1;
+				break;
+			case seam_map_kind::enlarge:
+				rank_bytes = sizeof(dancing_link_retargeter::enlarge_rank_t);
+				max_seams = std::min<std::uint64_t>(
+					hdr.orient == static_cast<std::uint32_t>(orientation::horizontal) ? hdr.width : hdr.height,
+					std::numeric_limits<dancing_link_retargeter::enlarge_rank_t>::max()
+				);
+				break;
+			default:
+				return false;
+			}
+			// the offset must keep the ranks aligned, the mapping itself starts on a page boundary
+			return
+				hdr.rank_bytes == rank_bytes && hdr.data_offset >= sizeof(seam_map_header) &&
+				hdr.data_offset % rank_bytes == 0 && hdr.data_offset <= file_size &&
+				hdr.width != 0 && hdr.height != 0 && hdr.height <= (file_size - hdr.data_offset) / rank_bytes / hdr.width &&
+				hdr.seams <= max_seams;
+		}
+
+		static bool _save(
+			LPCWSTR filename, seam_map_kind kind, orientation orient, size_t w, size_t h, size_t seams,
+			std::uint64_t content_hash, const void *ranks, size_t rank_bytes
+		) {
+			seam_map_header hdr;
+			std::memset(&hdr, 0, sizeof(hdr));
+			std::memcpy(hdr.magic, seam_map_header::magic_value(), sizeof(hdr.magic));
+			hdr.version = seam_map_header::current_version;
+			hdr.kind = static_cast<std::uint32_t>(kind);
+			hdr.orient = static_cast<std::uint32_t>(orient);
+			hdr.rank_bytes = static_cast<std::uint32_t>(rank_bytes);
+			hdr.width = w;
+			hdr.height = h;
+			hdr.seams = seams;
+			hdr.content_hash = content_hash;
+			hdr.data_offset = sizeof(seam_map_header);
+			HANDLE file = CreateFileW(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			bool ok = _write(file, &hdr, sizeof(hdr)) && _write(file, ranks, rank_bytes * w * h);
+			SC_WINAPI_CHECK(CloseHandle(file));
+			if (!ok) {
+				DeleteFileW(filename);
+			}
+			return ok;
+		}
+		static bool _write(HANDLE file, const void *data, size_t bytes) {
+			const unsigned char *ptr = static_cast<const unsigned char*>(data);
+			while (bytes > 0) {
+				DWORD chunk = static_cast<DWORD>(std::min<size_t>(bytes, 1 << 30)), written = 0;
+				if (!WriteFile(file, ptr, chunk, &written, nullptr) || written == 0) {
+					return false;
+				}
+				ptr += written;
+				bytes -= written;
+			}
+			return true;
+		}
+	};
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+//#define DISABLE_SIMD
+
+#if !defined(DISABLE_SIMD) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#	define SC_SIMD_X86
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#endif
+
+// MSVC accepts any intrinsic regardless of /arch, GCC & clang need the target enabled per function
+// (SSE2 too: 32-bit builds do not enable it by default)
+#if defined(SC_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#	define SC_TARGET_SSE2 __attribute__((target("sse2")))
+#	define SC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#	define SC_TARGET_SSE2
+#	define SC_TARGET_AVX2
+#endif
+
+namespace seam_carving {
+	enum class simd_level {
+		none,
+		sse2,
+		avx2
+	};
+
+	inline simd_level detect_simd_level() {
+#ifdef SC_SIMD_X86
+#	ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		int maxid = info[0];
+		__cpuid(info, 1);
+		if ((info[3] & (1 << 26)) == 0) {
+			return simd_level::none;
+		}
+		// AVX state must also be enabled by the OS (OSXSAVE + XCR0 bits)
+		bool osavx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+		if (osavx && maxid >= 7) {
+			__cpuidex(info, 7, 0);
+			if ((info[1] & (1 << 5)) != 0) {
+				return simd_level::avx2;
+			}
+		}
+		return simd_level::sse2;
+#	else
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return simd_level::avx2;
+		}
+		if (__builtin_cpu_supports("sse2")) {
+			return simd_level::sse2;
+		}
+#	endif
+#endif
+		return simd_level::none;
+	}
+	inline simd_level get_simd_level() {
+		static const simd_level level = detect_simd_level();
+		return level;
+	}
+}
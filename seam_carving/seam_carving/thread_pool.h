@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+
+namespace seam_carving {
+	// threads wait by spinning: a DP row takes microseconds, much less than a sleep / wake-up round trip
+	class spin_barrier {
+	public:
+		void reset(size_t count) {
+			_count = count;
+			_waiting.store(0, std::memory_order_relaxed);
+		}
+		void wait() {
+			size_t gen = _generation.load(std::memory_order_acquire);
+			if (_waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == _count) {
+				_waiting.store(0, std::memory_order_relaxed);
+				_generation.fetch_add(1, std::memory_order_release);
+				return;
+			}
+			for (size_t spins = 0; _generation.load(std::memory_order_acquire) == gen; ++spins) {
+				if (spins > 4096) {
+					std::this_thread::yield();
+				}
+			}
+		}
+	protected:
+		size_t _count = 1;
+		std::atomic<size_t> _waiting{0}, _generation{0};
+	};
+
+	// a fixed set of threads that all run the same job; the calling thread takes part as thread 0.
+	// Jobs are passed as a function pointer and a context so that running one never allocates
+	class thread_pool {
+	public:
+		explicit thread_pool(size_t threads) {
+			for (size_t i = 1; i < threads; ++i) {
+				_workers.emplace_back([this, i]() {
+					_work(i);
+				});
+			}
+		}
+		thread_pool(const thread_pool&) = delete;
+		thread_pool &operator=(const thread_pool&) = delete;
+		~thread_pool() {
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				_stop = true;
+				++_job_id;
+			}
+			_start.notify_all();
+			for (std::thread &t : _workers) {
+				t.join();
+			}
+		}
+
+		size_t size() const {
+			return _workers.size() + 1;
+		}
+		// calls func(i) on thread i for every i in [0, size()) and returns once all calls have finished
+		template <typename Func> void run(Func &&func) {
+			using func_t = typename std::remove_reference<Func>::type;
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				_job = [](void *f, size_t i) {
+					(*static_cast<func_t*>(f))(i);
+				};
+				_job_data = const_cast<void*>(static_cast<const void*>(&func));
+				_pending = _workers.size();
+				++_job_id;
+			}
+			_start.notify_all();
+			func(0);
+			std::unique_lock<std::mutex> guard(_lock);
+			_done.wait(guard, [this]() {
+				return _pending == 0;
+			});
+		}
+	protected:
+		std::vector<std::thread> _workers;
+		std::mutex _lock;
+		std::condition_variable _start, _done;
+		void (*_job)(void*, size_t) = nullptr;
+		void *_job_data = nullptr;
+		size_t _job_id = 0, _pending = 0;
+		bool _stop = false;
+
+		void _work(size_t id) {
+			size_t seen = 0;
+			while (true) {
+				std::unique_lock<std::mutex> guard(_lock);
+				_start.wait(guard, [this, &seen]() {
+					return _job_id != seen;
+				});
+				seen = _job_id;
+				if (_stop) {
+					return;
+				}
+				void (*job)(void*, size_t) = _job;
+				void *data = _job_data;
+				guard.unlock();
+				job(data, id);
+				guard.lock();
+				if (--_pending == 0) {
+					_done.notify_one();
+				}
+			}
+		}
+	};
+
+	// row-parallel DP sweeps shared by the carvers: every row is split into one chunk per thread and all threads
+	// meet at a barrier before starting the next row. Each cell is still computed by the serial code from the
+	// same inputs, so the result does not depend on the number of threads
+	class parallel_dp {
+	public:
+		constexpr static size_t default_min_width = 2048;
+
+		// 0 threads uses all hardware threads, 1 disables the parallel sweep
+		void set_threads(size_t threads, size_t min_width = default_min_width) {
+			if (threads == 0) {
+				threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			}
+			_min_width = min_width;
+			if (threads != get_threads()) {
+				_pool.reset(threads > 1 ? new thread_pool(threads) : nullptr);
+			}
+		}
+		size_t get_threads() const {
+			return _pool ? _pool->size() : 1;
+		}
+		size_t get_min_width() const {
+			return _min_width;
+		}
+		bool enabled_for(size_t width) const {
+			return _pool && width >= _min_width;
+		}
+
+		// calls func(thread, threads, barrier) on every thread
+		template <typename Func> void run(Func &&func) {
+			size_t n = _pool->size();
+			_barrier.reset(n);
+			_pool->run([this, n, &func](size_t t) {
+				func(t, n, _barrier);
+			});
+		}
+		// chunk t of n covers [chunk_begin(t, n, w), chunk_begin(t + 1, n, w)). Boundaries are multiples of 4 so that
+		// no two threads write to the same byte of packed DP codes
+		inline static size_t chunk_begin(size_t t, size_t n, size_t w) {
+			return std::min(w, (w * t / n + 3) & ~static_cast<size_t>(3));
+		}
+	protected:
+		std::unique_ptr<thread_pool> _pool;
+		spin_barrier _barrier;
+		size_t _min_width = default_min_width;
+	};
+}
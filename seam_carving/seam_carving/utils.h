@@ -53,7 +53,9 @@ namespace seam_carving {
 			src._ps = nullptr;
 		}
 		dynamic_array2(const dynamic_array2 &src) : dynamic_array2(src._w, src._h) {
-			std::memcpy(_ps, src._ps, sizeof(Elem) * _w * _h);
+			if (_ps) {
+				std::memcpy(_ps, src._ps, sizeof(Elem) * _w * _h);
+			}
 		}
 		dynamic_array2 &operator=(dynamic_array2 src) {
 			std::swap(_w, src._w);
@@ -113,6 +115,27 @@ namespace seam_carving {
 		size_t _w = 0, _h = 0;
 	};
 
+	// writes the transpose of the w x h block at src into dst tile by tile, so that both sides stay within
+	// a few cache lines; rows of src and dst are srcstride and dststride elements apart
+	template <typename Elem> void transpose(
+		const Elem *src, size_t srcstride, Elem *dst, size_t dststride, size_t w, size_t h
+	) {
+		constexpr size_t block = 32;
+		assert(w <= srcstride && h <= dststride);
+		for (size_t by = 0; by < h; by += block) {
+			size_t yend = std::min(by + block, h);
+			for (size_t bx = 0; bx < w; bx += block) {
+				size_t xend = std::min(bx + block, w);
+				for (size_t y = by; y < yend; ++y) {
+					const Elem *s = src + (y * srcstride + bx);
+					for (size_t x = bx; x < xend; ++x, ++s) {
+						dst[x * dststride + y] = *s;
+					}
+				}
+			}
+		}
+	}
+
 	inline std::chrono::high_resolution_clock::time_point now() {
 		return std::chrono::high_resolution_clock::now();
 	}